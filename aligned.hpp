@@ -0,0 +1,89 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ALIGNED_HPP__
+#define ALIGNED_HPP__
+
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+// Value-initialized array starting on a cache line.
+// Only (re)allocates in resize(), never while in use.
+template<typename T>
+class AlignedArray
+{
+   public:
+      enum { alignment = 64 };
+
+      AlignedArray() = default;
+      explicit AlignedArray(size_t count)
+      {
+         resize(count);
+      }
+
+      ~AlignedArray()
+      {
+         destroy();
+      }
+
+      AlignedArray(AlignedArray &&other)
+      {
+         *this = std::move(other);
+      }
+
+      AlignedArray &operator=(AlignedArray &&other)
+      {
+         std::swap(buffer, other.buffer);
+         std::swap(count, other.count);
+         return *this;
+      }
+
+      void resize(size_t count)
+      {
+         destroy();
+         if (!count)
+            return;
+
+         void *ptr = nullptr;
+         if (posix_memalign(&ptr, alignment, count * sizeof(T)) != 0)
+            throw std::bad_alloc();
+         buffer = static_cast<T*>(ptr);
+         for (this->count = 0; this->count < count; this->count++)
+            new (&buffer[this->count]) T();
+      }
+
+      inline T *data() { return buffer; }
+      inline const T *data() const { return buffer; }
+      inline size_t size() const { return count; }
+      inline T &operator[](size_t index) { return buffer[index]; }
+      inline const T &operator[](size_t index) const { return buffer[index]; }
+
+   private:
+      T *buffer = nullptr;
+      size_t count = 0;
+
+      void destroy()
+      {
+         for (size_t i = 0; i < count; i++)
+            buffer[i].~T();
+         free(buffer);
+         buffer = nullptr;
+         count = 0;
+      }
+};
+
+#endif
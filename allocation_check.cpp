@@ -0,0 +1,96 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+// Replaces malloc() and friends of the program, so AllocationCheck sees all heap use,
+// of C++ code through operator new as well as of C code and libraries. Forwards to the
+// allocator of glibc. Not part of the LV2 plugin, where the host owns the heap.
+
+#include "realtime.hpp"
+#include <cstdlib>
+#include <cerrno>
+
+extern "C"
+{
+   void *__libc_malloc(size_t size);
+   void *__libc_calloc(size_t count, size_t size);
+   void *__libc_realloc(void *ptr, size_t size);
+   void *__libc_memalign(size_t alignment, size_t size);
+   void *__libc_valloc(size_t size);
+   void *__libc_pvalloc(size_t size);
+   void __libc_free(void *ptr);
+
+   void *malloc(size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      return __libc_malloc(size);
+   }
+
+   void *calloc(size_t count, size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      return __libc_calloc(count, size);
+   }
+
+   void *realloc(void *ptr, size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      return __libc_realloc(ptr, size);
+   }
+
+   void free(void *ptr) noexcept
+   {
+      if (ptr)
+         AllocationCheck::heap_used();
+      __libc_free(ptr);
+   }
+
+   int posix_memalign(void **ptr, size_t alignment, size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void*))
+         return EINVAL;
+      void *ret = __libc_memalign(alignment, size);
+      if (!ret)
+         return ENOMEM;
+      *ptr = ret;
+      return 0;
+   }
+
+   void *aligned_alloc(size_t alignment, size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      return __libc_memalign(alignment, size);
+   }
+
+   void *memalign(size_t alignment, size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      return __libc_memalign(alignment, size);
+   }
+
+   void *valloc(size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      return __libc_valloc(size);
+   }
+
+   void *pvalloc(size_t size) noexcept
+   {
+      AllocationCheck::heap_used();
+      return __libc_pvalloc(size);
+   }
+}
@@ -0,0 +1,258 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "synth.hpp"
+#include <cmath>
+
+using namespace std;
+
+void IndexList::push_back(Link *links, unsigned index)
+{
+   links[index].prev = tail;
+   links[index].next = invalid;
+   if (tail != invalid)
+      links[tail].next = index;
+   else
+      head = index;
+   tail = index;
+   count++;
+}
+
+void IndexList::remove(Link *links, unsigned index)
+{
+   auto &link = links[index];
+   if (link.prev != invalid)
+      links[link.prev].next = link.next;
+   else
+      head = link.next;
+
+   if (link.next != invalid)
+      links[link.next].prev = link.prev;
+   else
+      tail = link.prev;
+
+   link.prev = link.next = invalid;
+   count--;
+}
+
+void VoiceAllocator::init(unsigned num_voices)
+{
+   slots.clear();
+   slots.resize(num_voices);
+   age_links.clear();
+   age_links.resize(num_voices);
+   level_links.clear();
+   level_links.resize(num_voices);
+   note_links.clear();
+   note_links.resize(num_voices);
+   sustain_links.clear();
+   sustain_links.resize(num_voices);
+   free_list.reserve(num_voices);
+   reset();
+}
+
+void VoiceAllocator::reset()
+{
+   held.clear();
+   released.clear();
+   fading.clear();
+   sustained.clear();
+   for (auto &list : held_levels)
+      list.clear();
+   for (auto &list : released_levels)
+      list.clear();
+   for (auto &list : notes)
+      list.clear();
+
+   // Lowest index is handed out first.
+   free_list.clear();
+   for (unsigned i = slots.size(); i; i--)
+   {
+      slots[i - 1] = {};
+      free_list.push_back(i - 1);
+   }
+   age_counter = 0;
+}
+
+unsigned VoiceAllocator::pop_free()
+{
+   if (free_list.empty())
+      return invalid;
+
+   unsigned index = free_list.back();
+   free_list.pop_back();
+   slots[index].state = State::Reserved;
+   return index;
+}
+
+void VoiceAllocator::triggered(unsigned index, unsigned note)
+{
+   auto &slot = slots[index];
+   slot.state = State::Held;
+   slot.note = note & 127;
+   slot.level = num_levels - 1;
+   slot.age = age_counter++;
+
+   held.push_back(age_links.data(), index);
+   held_levels[slot.level].push_back(level_links.data(), index);
+   notes[slot.note].push_back(note_links.data(), index);
+}
+
+void VoiceAllocator::sustain(unsigned index)
+{
+   auto &slot = slots[index];
+   if (slot.state != State::Held || slot.sustained)
+      return;
+
+   slot.sustained = true;
+   sustained.push_back(sustain_links.data(), index);
+}
+
+void VoiceAllocator::unlink(unsigned index)
+{
+   auto &slot = slots[index];
+   if (slot.sustained)
+   {
+      sustained.remove(sustain_links.data(), index);
+      slot.sustained = false;
+   }
+
+   switch (slot.state)
+   {
+      case State::Held:
+         held.remove(age_links.data(), index);
+         held_levels[slot.level].remove(level_links.data(), index);
+         notes[slot.note].remove(note_links.data(), index);
+         break;
+
+      case State::Released:
+         released.remove(age_links.data(), index);
+         released_levels[slot.level].remove(level_links.data(), index);
+         notes[slot.note].remove(note_links.data(), index);
+         break;
+
+      case State::Fading:
+         fading.remove(age_links.data(), index);
+         break;
+
+      default:
+         break;
+   }
+}
+
+void VoiceAllocator::release(unsigned index)
+{
+   auto &slot = slots[index];
+   if (slot.state != State::Held)
+      return;
+
+   if (slot.sustained)
+   {
+      sustained.remove(sustain_links.data(), index);
+      slot.sustained = false;
+   }
+
+   held.remove(age_links.data(), index);
+   held_levels[slot.level].remove(level_links.data(), index);
+   slot.state = State::Released;
+   released.push_back(age_links.data(), index);
+   released_levels[slot.level].push_back(level_links.data(), index);
+}
+
+void VoiceAllocator::fade(unsigned index)
+{
+   unlink(index);
+   slots[index].state = State::Fading;
+   fading.push_back(age_links.data(), index);
+}
+
+void VoiceAllocator::retire(unsigned index)
+{
+   auto &slot = slots[index];
+   if (slot.state == State::Free)
+      return;
+
+   unlink(index);
+   slot.state = State::Free;
+   free_list.push_back(index);
+}
+
+void VoiceAllocator::update_level(unsigned index, float amplitude)
+{
+   auto &slot = slots[index];
+
+   IndexList *levels;
+   if (slot.state == State::Held)
+      levels = held_levels;
+   else if (slot.state == State::Released)
+      levels = released_levels;
+   else
+      return;
+
+   // Every octave of amplitude is 6 dB.
+   int level = amplitude > 0.0f ? ilogb(amplitude) + num_levels : 0;
+   level = max(min(level, int(num_levels) - 1), 0);
+
+   if (level != slot.level)
+   {
+      levels[slot.level].remove(level_links.data(), index);
+      slot.level = level;
+      levels[level].push_back(level_links.data(), index);
+   }
+}
+
+unsigned VoiceAllocator::quietest(const IndexList *levels) const
+{
+   for (unsigned i = 0; i < num_levels; i++)
+      if (!levels[i].empty())
+         return levels[i].front();
+   return invalid;
+}
+
+unsigned VoiceAllocator::quietest() const
+{
+   for (unsigned i = 0; i < num_levels; i++)
+   {
+      if (!released_levels[i].empty())
+         return released_levels[i].front();
+      if (!held_levels[i].empty())
+         return held_levels[i].front();
+   }
+   return invalid;
+}
+
+unsigned VoiceAllocator::oldest() const
+{
+   unsigned held_index = held.front();
+   unsigned released_index = released.front();
+   if (held_index == invalid)
+      return released_index;
+   if (released_index == invalid)
+      return held_index;
+   return slots[held_index].age < slots[released_index].age ? held_index : released_index;
+}
+
+unsigned VoiceAllocator::select_victim(unsigned note) const
+{
+   if (policy.same_note_first && !notes[note & 127].empty())
+      return notes[note & 127].front();
+
+   bool quiet = policy.order == StealPolicy::Order::Quietest;
+   if (policy.released_first && !released.empty())
+      return quiet ? quietest(released_levels) : released.front();
+
+   return quiet ? quietest() : oldest();
+}
@@ -18,12 +18,12 @@
 
 using namespace std;
 
-void AudioCallback::process_midi(MidiRawData midi_raw)
+void AudioCallback::process_midi(MidiRawData midi_raw, unsigned frame)
 {
-   process_midi(get_event(midi_raw));
+   process_midi(get_event(midi_raw, frame));
 }
 
-AudioCallback::MidiEvent AudioCallback::get_event(MidiRawData midi_raw)
+AudioCallback::MidiEvent AudioCallback::get_event(MidiRawData midi_raw, unsigned frame)
 {
    Event e = Event::None;
    uint8_t event = midi_raw[0];
@@ -53,7 +53,23 @@ AudioCallback::MidiEvent AudioCallback::get_event(MidiRawData midi_raw)
       }
    }
 
-   return {e, channel, midi_raw[1], midi_raw[2]};
+   return {e, channel, midi_raw[1], midi_raw[2], frame};
+}
+
+AudioCallback::MidiRawData AudioCallback::get_raw(const MidiEvent &event)
+{
+   static const uint8_t system[] = {
+      0xf1, 0xf2, 0xf3, 0xf6,
+      0xf8, 0xfa, 0xfb, 0xfc, 0xfe, 0xff,
+   };
+
+   uint8_t status = 0;
+   if (event.event <= Event::PitchWheel)
+      status = uint8_t(0x80 | (unsigned(event.event) << 4) | (event.channel & 0xf));
+   else if (event.event < Event::None)
+      status = system[unsigned(event.event) - unsigned(Event::TimeCodeQuarter)];
+
+   return {{ status, uint8_t(event.lo), uint8_t(event.hi) }};
 }
 
 void AudioDriver::run()
@@ -25,6 +25,8 @@
 #include <utility>
 #include <vector>
 #include <array>
+#include <string>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
 
@@ -38,6 +40,7 @@ class AudioCallback
          Aftertouch,
          Control,
          Program,
+         ChannelPressure,
          PitchWheel,
 
          TimeCodeQuarter,
@@ -59,21 +62,47 @@ class AudioCallback
 
       struct MidiEvent
       {
-         inline MidiEvent(Event event, unsigned channel, unsigned lo, unsigned hi)
-            : event(event), channel(channel), lo(lo), hi(hi) {}
+         inline MidiEvent(Event event, unsigned channel, unsigned lo, unsigned hi, unsigned frame = 0)
+            : event(event), channel(channel), lo(lo), hi(hi), frame(frame) {}
          Event event;
          unsigned channel;
          unsigned lo, hi;
+
+         // Offset into the next process_audio() call where the event takes effect.
+         unsigned frame;
       };
 
+      // Must write every frame of audio. Drivers do not clear the buffers first.
       virtual void process_audio(float **audio, const float *amp, unsigned frames) = 0;
       virtual void configure_audio(unsigned sample_rate, unsigned channels) = 0;
 
+      // Output can be split into buses of channels channels each, e.g. one per MIDI channel.
+      // Drivers which support buses call process_buses() instead of process_audio(),
+      // with channel c of bus b at audio[b * channels + c], and amp per channel.
+      // Buses must be set up before the driver is created.
+      virtual unsigned buses() const { return 1; }
+      virtual std::string bus_name(unsigned) const { return ""; }
+      virtual void process_buses(float **audio, const float *amp, unsigned frames)
+      {
+         process_audio(audio, amp, frames);
+      }
+
+      // Called with the period size of the driver before audio is processed.
+      virtual void configure_buffer_size(unsigned) {}
+
+      // All events of a block are passed in time order before the block is rendered.
       virtual void process_midi(MidiEvent data) = 0;
-      void process_midi(MidiRawData midi_raw);
+      void process_midi(MidiRawData midi_raw, unsigned frame = 0);
 
-   private:
-      MidiEvent get_event(MidiRawData raw);
+      // True if process_audio() would produce nothing but silence until the next
+      // MIDI event. Drivers which are not bound to real time may skip such spans.
+      virtual bool idle() const { return false; }
+
+      // Decodes a raw MIDI message.
+      static MidiEvent get_event(MidiRawData raw, unsigned frame = 0);
+      // Encodes an event as a raw MIDI message, the inverse of get_event().
+      // Event::None encodes with a status byte of 0.
+      static MidiRawData get_raw(const MidiEvent &event);
 };
 
 class AudioDriver
@@ -94,27 +123,221 @@ class AudioDriver
       std::condition_variable cond;
 };
 
+class Recorder;
+class TraceWriter;
+class MidiQueue;
+class LookaheadRenderer;
+
 class JACKDriver : public AudioDriver
 {
    public:
-      JACKDriver(std::shared_ptr<AudioCallback> cb, unsigned channels);
+      // Output is also recorded to record_path, unless it is empty. See Recorder.
+      // A non-zero lookahead_ms renders on a thread of its own, at least two
+      // periods ahead. See LookaheadRenderer.
+      // Every bus of the callback gets ports of its own, and is recorded as
+      // channels channels of the file.
+      // MIDI and blocks are traced to trace_path, unless it is empty. See TraceWriter.
+      JACKDriver(std::shared_ptr<AudioCallback> cb, unsigned channels,
+            const std::string &record_path = "", unsigned lookahead_ms = 0,
+            const std::string &trace_path = "");
       ~JACKDriver();
 
       JACKDriver(JACKDriver&&) = delete;
       void operator=(JACKDriver&&) = delete;
 
-      // JACK Callback
+      // JACK Callbacks
       int process(jack_nframes_t frames);
+      int buffer_size_changed(jack_nframes_t frames);
+      int sample_rate_changed(jack_nframes_t sample_rate);
+      int xrun();
+
+      // Events from other threads, merged with the MIDI port in time order.
+      // Times are in the microseconds of now(), events which are late play at
+      // the start of the next block.
+      inline MidiQueue &midi_queue() { return *queue; }
+      static inline uint64_t now() { return jack_get_time(); }
 
    private:
-      bool init(unsigned channels);
+      bool init(unsigned channels, const std::string &record_path, const std::string &trace_path);
       void term();
+      void render(jack_nframes_t frames);
+
+      // Called on a JACK notification thread, or before activation. Changes are made
+      // while process() is kept out, so it never sees a half-built configuration
+      // and nothing is allocated on the audio thread.
+      bool reconfigure(unsigned sample_rate, unsigned max_frames);
+      std::mutex reconfigure_lock;
+      // process() outputs silence without touching anything else while reconfiguring is set.
+      std::atomic<bool> reconfiguring{false};
+      std::atomic<bool> in_process{false};
+      bool stack_prefaulted = false;
 
       jack_client_t *client = nullptr;
       std::vector<jack_port_t*> audio_ports;
       jack_port_t *midi_port = nullptr;
       std::vector<float*> target_ptrs;
       std::vector<float> amps;
+      unsigned channels = 0;
+      unsigned buses = 1;
+      unsigned sample_rate = 0;
+      unsigned max_frames = 0;
+      unsigned lookahead_ms = 0;
+
+      std::unique_ptr<Recorder> recorder;
+      std::unique_ptr<TraceWriter> trace;
+      // Counted on a notification thread, traced by the next block.
+      std::atomic<unsigned> xruns{0};
+      unsigned traced_xruns = 0;
+      std::unique_ptr<MidiQueue> queue;
+      std::unique_ptr<LookaheadRenderer> lookahead;
+};
+
+class MidiFile;
+class AudioSink;
+
+// Renders a Standard MIDI File as fast as the CPU allows, in large blocks.
+// Silent spans between notes are written without rendering.
+class OfflineDriver : public AudioDriver
+{
+   public:
+      OfflineDriver(std::shared_ptr<AudioCallback> cb, MidiFile &midi, AudioSink &sink,
+            unsigned channels, unsigned sample_rate);
+
+      OfflineDriver(OfflineDriver&&) = delete;
+      void operator=(OfflineDriver&&) = delete;
+
+      enum { block_frames = 4096 };
+
+      struct Result
+      {
+         uint64_t frames;   // Written to the sink.
+         uint64_t rendered; // Of those, frames which were rendered.
+      };
+
+      // Renders until the last note has died out, at most max_tail seconds
+      // after the last event, or until stop() is called.
+      Result render();
+      void stop();
+
+      float max_tail = 10.0f;
+
+   private:
+      MidiFile &midi;
+      AudioSink &sink;
+      unsigned channels;
+      unsigned sample_rate;
+      std::atomic<bool> stopped{false};
+
+      std::vector<float> buffer;
+      std::vector<float*> buffer_ptrs;
+      std::vector<float> interleaved;
+      std::vector<float> amps;
+
+      void write(unsigned frames, bool silence);
+};
+
+// Streams MIDI in and PCM out through file descriptors, such as stdin and stdout
+// or FIFOs. Input is a sequence of 8 byte events: frames since the previous event
+// as a little endian uint32, the three bytes of a MIDI message, and one unused byte.
+// Output is interleaved little endian float or int16 PCM.
+//
+// Unpaced, the stream renders as fast as input arrives and output is taken, and event
+// times are exact. Paced, blocks are written no faster than real time and input is
+// never waited for, so events which arrive late play at the start of the next block.
+class PipeDriver : public AudioDriver
+{
+   public:
+      enum class Format { Float, Int16 };
+
+      PipeDriver(std::shared_ptr<AudioCallback> cb, int input_fd, int output_fd,
+            unsigned channels, unsigned sample_rate, Format format, bool paced,
+            unsigned block_frames = 4096);
+
+      PipeDriver(PipeDriver&&) = delete;
+      void operator=(PipeDriver&&) = delete;
+
+      enum { event_size = 8 };
+
+      // Streams until the input ends and the last note has died out, at most max_tail
+      // seconds later, until the output is closed, or until stop() is called.
+      // Returns the frames written.
+      uint64_t render();
+      void stop();
+
+      float max_tail = 10.0f;
+
+   private:
+      int input_fd;
+      int output_fd;
+      unsigned channels;
+      unsigned sample_rate;
+      Format format;
+      bool paced;
+      unsigned block_frames;
+      std::atomic<bool> stopped{false};
+
+      std::vector<float> buffer;
+      std::vector<float*> buffer_ptrs;
+      std::vector<float> amps;
+      // Interleaved and converted, written to the output from here.
+      std::vector<uint8_t> output;
+
+      // Input which has not been parsed yet.
+      std::vector<uint8_t> input;
+      size_t input_pos = 0;
+      size_t input_end = 0;
+      bool input_done = false;
+
+      bool read_input(bool wait);
+      bool next_event(uint64_t &time, AudioCallback::MidiRawData &data, bool wait);
+      bool write(unsigned frames, bool silence);
+};
+
+class TraceReader;
+
+// Drives the callback with the exact events and blocks of a session trace, as fast as
+// the CPU allows, and times every block against the period it had to finish in live.
+// Every run of a trace renders the same workload, so it can be profiled repeatedly.
+class ReplayDriver : public AudioDriver
+{
+   public:
+      // Audio of every bus is written to sink, unless it is null. The callback must
+      // have the buses of the trace for the workload to be the same.
+      ReplayDriver(std::shared_ptr<AudioCallback> cb, TraceReader &trace, AudioSink *sink);
+
+      ReplayDriver(ReplayDriver&&) = delete;
+      void operator=(ReplayDriver&&) = delete;
+
+      struct Result
+      {
+         uint64_t blocks;
+         uint64_t frames;
+         double seconds;       // Spent rendering.
+         uint64_t late_blocks; // Took longer than their period.
+         uint64_t worst_block; // Took the largest part of its period.
+         double worst_load;
+         uint64_t worst_frame; // Where the worst block starts.
+         unsigned xruns;       // Reported live.
+         // Blocks which touched the heap, including their MIDI, and the first of them.
+         // Only counted while AllocationCheck is enabled.
+         uint64_t allocating_blocks;
+         uint64_t first_allocating_block;
+      };
+
+      // Replays the trace from the start, until its end or until stop() is called.
+      Result render();
+      void stop();
+
+   private:
+      TraceReader &trace;
+      AudioSink *sink;
+      unsigned channels;
+      std::atomic<bool> stopped{false};
+
+      std::vector<float> buffer;
+      std::vector<float*> buffer_ptrs;
+      std::vector<float> interleaved;
+      std::vector<float> amps;
 };
 
 
@@ -0,0 +1,58 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "audio_sink.hpp"
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+SndfileSink::SndfileSink(const string &path, unsigned channels, unsigned sample_rate)
+   : channels(channels)
+{
+   bool flac = path.size() >= 5 && path.compare(path.size() - 5, 5, ".flac") == 0;
+
+   SF_INFO info = {};
+   info.samplerate = sample_rate;
+   info.channels = channels;
+   info.format = flac ? (SF_FORMAT_FLAC | SF_FORMAT_PCM_24) : (SF_FORMAT_WAV | SF_FORMAT_FLOAT);
+   file = sf_open(path.c_str(), SFM_WRITE, &info);
+   if (!file)
+      throw runtime_error("Failed to open " + path + ": " + sf_strerror(nullptr));
+
+   // Overs clip rather than wrap around when converted to integers.
+   if (flac)
+      sf_command(file, SFC_SET_CLIPPING, nullptr, SF_TRUE);
+}
+
+SndfileSink::~SndfileSink()
+{
+   if (file)
+      sf_close(file);
+}
+
+void SndfileSink::write(const float *audio, unsigned frames)
+{
+   if (!audio)
+   {
+      if (silence.size() < frames * channels)
+         silence.resize(frames * channels);
+      audio = silence.data();
+   }
+
+   if (sf_writef_float(file, audio, frames) != sf_count_t(frames))
+      throw runtime_error(string("Failed to write audio: ") + sf_strerror(file));
+}
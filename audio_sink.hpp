@@ -0,0 +1,53 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AUDIO_SINK_HPP__
+#define AUDIO_SINK_HPP__
+
+#include <sndfile.h>
+#include <string>
+#include <vector>
+
+// Destination of audio rendered offline.
+class AudioSink
+{
+   public:
+      virtual ~AudioSink() = default;
+
+      // Interleaved frames, or silence if audio is null.
+      virtual void write(const float *audio, unsigned frames) = 0;
+};
+
+// Audio file written through libsndfile. Paths ending in .flac are
+// encoded as 24-bit FLAC, anything else as float WAV.
+class SndfileSink : public AudioSink
+{
+   public:
+      SndfileSink(const std::string &path, unsigned channels, unsigned sample_rate);
+      ~SndfileSink();
+
+      SndfileSink(SndfileSink&&) = delete;
+      void operator=(SndfileSink&&) = delete;
+
+      void write(const float *audio, unsigned frames) override;
+
+   private:
+      SNDFILE *file = nullptr;
+      unsigned channels;
+      std::vector<float> silence;
+};
+
+#endif
@@ -56,9 +56,15 @@ struct blipper
    unsigned phases_log2;
    unsigned taps;
 
+   /* Filter used for new deltas. Can be shorter than taps. */
+   const blipper_sample_t *active_bank;
+   unsigned active_taps;
+   unsigned tap_offset;
+
    blipper_long_sample_t integrator;
    blipper_long_sample_t ramp;
    blipper_sample_t last_sample;
+   unsigned denormals;
 
 #if BLIPPER_LOG_PERFORMANCE
    double total_time;
@@ -315,6 +321,7 @@ void blipper_reset(blipper_t *blip)
    blip->last_sample = 0;
    blip->integrator = 0;
    blip->ramp = 0;
+   blip->denormals = 0;
 }
 
 blipper_t *blipper_new(unsigned taps, double cutoff, double beta,
@@ -355,6 +362,9 @@ blipper_t *blipper_new(unsigned taps, double cutoff, double beta,
    else
       blip->filter_bank = (blipper_sample_t*)filter_bank;
 
+   blip->active_bank = blip->filter_bank;
+   blip->active_taps = taps;
+
    blip->output_buffer = (blipper_long_sample_t*)calloc(buffer_samples + blip->taps,
          sizeof(*blip->output_buffer));
    if (!blip->output_buffer)
@@ -379,10 +389,10 @@ void blipper_push_delta(blipper_t *blip, blipper_long_sample_t delta, unsigned c
    target_output = (blip->phase + blip->phases - 1) >> blip->phases_log2;
 
    filter_phase = (target_output << blip->phases_log2) - blip->phase;
-   response = blip->filter_bank + blip->taps * filter_phase;
+   response = blip->active_bank + blip->active_taps * filter_phase;
 
-   target = blip->output_buffer + target_output;
-   taps = blip->taps;
+   target = blip->output_buffer + target_output + blip->tap_offset;
+   taps = blip->active_taps;
 
    for (i = 0; i < taps; i++)
       target[i] += delta * response[i];
@@ -390,6 +400,29 @@ void blipper_push_delta(blipper_t *blip, blipper_long_sample_t delta, unsigned c
    blip->output_avail = target_output;
 }
 
+int blipper_set_filter_bank(blipper_t *blip, unsigned taps,
+      const blipper_sample_t *filter_bank)
+{
+   if (taps > blip->taps || ((blip->taps - taps) & 1))
+      return 0;
+
+   if (filter_bank)
+   {
+      blip->active_bank = filter_bank;
+      blip->active_taps = taps;
+   }
+   else
+   {
+      blip->active_bank = blip->filter_bank;
+      blip->active_taps = blip->taps;
+   }
+
+   /* Center the shorter impulse on the original one,
+    * so the group delay stays the same. */
+   blip->tap_offset = (blip->taps - blip->active_taps) >> 1;
+   return 1;
+}
+
 void blipper_push_samples(blipper_t *blip, const blipper_sample_t *data,
       unsigned samples, unsigned stride)
 {
@@ -429,6 +462,13 @@ unsigned blipper_read_avail(blipper_t *blip)
    return blip->output_avail;
 }
 
+unsigned blipper_denormals(blipper_t *blip)
+{
+   unsigned ret = blip->denormals;
+   blip->denormals = 0;
+   return ret;
+}
+
 void blipper_read(blipper_t *blip, blipper_sample_t *output, unsigned samples,
       unsigned stride)
 {
@@ -471,6 +511,14 @@ void blipper_read(blipper_t *blip, blipper_sample_t *output, unsigned samples,
       sum += out[s] + ramp - sum * 0.00195f;
       *output = sum;
    }
+
+   /* Without input, the leaky integrator decays towards zero
+    * and would eventually end up as a subnormal number. */
+   if (sum != 0.0f && fabs(sum) < 1e-30f)
+   {
+      sum = 0.0f;
+      blip->denormals++;
+   }
 #endif
 
    /* Don't bother with ring buffering.
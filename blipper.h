@@ -125,6 +125,20 @@ blipper_sample_t *blipper_create_filter_bank(unsigned decimation,
 #define blipper_free BLIPPER_MANGLE(blipper_free)
 void blipper_free(blipper_t *blip);
 
+/* Switches the filter used for subsequently pushed deltas.
+ * Deltas which have already been pushed are not affected, so this can be
+ * called at any time without discontinuities.
+ * filter_bank must have been created by blipper_create_filter_bank() with the
+ * same decimation, and taps cannot exceed taps passed to blipper_new().
+ * The difference in taps must be even, as the shorter filter is centered
+ * on the original one to keep the same delay.
+ * If filter_bank is NULL, the original filter is restored.
+ * Returns 0 if the filter cannot be used.
+ */
+#define blipper_set_filter_bank BLIPPER_MANGLE(blipper_set_filter_bank)
+int blipper_set_filter_bank(blipper_t *blip, unsigned taps,
+      const blipper_sample_t *filter_bank);
+
 /* Add a ramp to the synthesized wave. The ramp is added to the integrator
  * on every input sample.
  * The amount added is delta / clocks per input sample.
@@ -166,6 +180,13 @@ void blipper_push_samples(blipper_t *blip, const blipper_sample_t *delta,
 #define blipper_read_avail BLIPPER_MANGLE(blipper_read_avail)
 unsigned blipper_read_avail(blipper_t *blip);
 
+/* Returns the number of times the leaky integrator has been flushed
+ * to zero to avoid subnormal numbers since the last call.
+ * Always returns 0 for the fixed point implementation.
+ */
+#define blipper_denormals BLIPPER_MANGLE(blipper_denormals)
+unsigned blipper_denormals(blipper_t *blip);
+
 /* Reads processed samples. The caller must ensure to not read
  * more than what is returned from blipper_read_avail().
  * As in blipper_push_samples(), stride is the number of samples
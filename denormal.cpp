@@ -0,0 +1,37 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "denormal.hpp"
+#include <cstdio>
+
+using namespace std;
+
+static atomic<DenormalCounter*> counter_list;
+
+DenormalCounter::DenormalCounter(const char *name)
+   : name(name), count(0), next(counter_list.load())
+{
+   while (!counter_list.compare_exchange_weak(next, this));
+}
+
+void DenormalCounter::report()
+{
+#if AIRSYNTH_DENORMAL_STATS
+   for (auto counter = counter_list.load(); counter; counter = counter->next)
+      fprintf(stderr, "[denormal]: %s flushed %lu subnormal values.\n",
+            counter->name, counter->count.load());
+#endif
+}
@@ -0,0 +1,118 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef DENORMAL_HPP__
+#define DENORMAL_HPP__
+
+#include <atomic>
+#include <cmath>
+
+#if defined(__SSE__) || defined(__x86_64__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define AIRSYNTH_DENORMAL_SSE 1
+#endif
+
+// Compile time configurable. Counts how often DSP state had to be flushed
+// to avoid subnormal floats. Enabled by default in DEBUG builds.
+#ifndef AIRSYNTH_DENORMAL_STATS
+#define AIRSYNTH_DENORMAL_STATS 0
+#endif
+
+// Enables flush-to-zero and denormals-are-zero on the calling thread
+// for the lifetime of the object. Instantiate at the top of every render callback.
+class DenormalGuard
+{
+   public:
+      inline DenormalGuard()
+      {
+#if defined(AIRSYNTH_DENORMAL_SSE)
+         csr = _mm_getcsr();
+         _mm_setcsr(csr | ftz_daz);
+#elif defined(__aarch64__)
+         asm volatile("mrs %0, fpcr" : "=r"(csr));
+         asm volatile("msr fpcr, %0" : : "r"(csr | fpcr_fz));
+#endif
+      }
+
+      inline ~DenormalGuard()
+      {
+#if defined(AIRSYNTH_DENORMAL_SSE)
+         _mm_setcsr(csr);
+#elif defined(__aarch64__)
+         asm volatile("msr fpcr, %0" : : "r"(csr));
+#endif
+      }
+
+      DenormalGuard(const DenormalGuard&) = delete;
+      void operator=(const DenormalGuard&) = delete;
+
+   private:
+#if defined(AIRSYNTH_DENORMAL_SSE)
+      static const unsigned ftz_daz = 0x8040;
+      unsigned csr;
+#elif defined(__aarch64__)
+      static const unsigned long fpcr_fz = 1ul << 24;
+      unsigned long csr;
+#endif
+};
+
+// Per-engine debug counter. Counters register themselves globally and
+// can be dumped with DenormalCounter::report().
+class DenormalCounter
+{
+   public:
+      DenormalCounter(const char *name);
+
+      inline void hit(unsigned hits = 1)
+      {
+#if AIRSYNTH_DENORMAL_STATS
+         if (hits)
+            count.fetch_add(hits, std::memory_order_relaxed);
+#else
+         (void)hits;
+#endif
+      }
+
+      static void report();
+
+   private:
+      const char *name;
+      std::atomic<unsigned long> count;
+      DenormalCounter *next;
+};
+
+// Anything below this is far below audibility, and would turn subnormal
+// after a few more iterations of a decaying filter.
+static const float denormal_floor = 1e-30f;
+
+// Use on state which persists across blocks.
+static inline void flush_denormal(float &v, DenormalCounter &counter)
+{
+   if (std::fabs(v) < denormal_floor && v != 0.0f)
+   {
+      v = 0.0f;
+      counter.hit();
+   }
+}
+
+static inline void flush_denormals(float *v, unsigned len, DenormalCounter &counter)
+{
+   for (unsigned i = 0; i < len; i++)
+      flush_denormal(v[i], counter);
+}
+
+#endif
+
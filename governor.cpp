@@ -0,0 +1,76 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "governor.hpp"
+#include <algorithm>
+
+using namespace std;
+
+void LoadGovernor::configure(unsigned sample_rate, unsigned period_frames, unsigned max_voices)
+{
+   this->sample_rate = sample_rate;
+   this->period_frames = max(period_frames, 1u);
+   this->max_voices = max_voices;
+   recover_frames = unsigned(recover_time * sample_rate);
+   recover_counter = 0;
+   elapsed = 0.0;
+   frames = 0;
+
+   current_limit = max_voices;
+   stats.limit.store(current_limit, memory_order_relaxed);
+}
+
+unsigned LoadGovernor::end(unsigned frames, unsigned active_voices)
+{
+   elapsed += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+   this->frames += frames;
+
+   // Each driver block is timed as one render, MIDI included. Blocks shorter than a
+   // period, such as around a buffer size change, are pooled until a full period is timed.
+   if (this->frames < period_frames)
+      return current_limit;
+
+   float load = float(elapsed * sample_rate / this->frames);
+   unsigned window = this->frames;
+   elapsed = 0.0;
+   this->frames = 0;
+
+   stats.load.store(load, memory_order_relaxed);
+   if (load > stats.peak_load.load(memory_order_relaxed))
+      stats.peak_load.store(load, memory_order_relaxed);
+
+   if (load > high_load && active_voices > 1)
+   {
+      // Assume cost scales with voices, and aim for the target load.
+      unsigned limit = unsigned(active_voices * target_load / load);
+      current_limit = max(min(limit, current_limit), 1u);
+      recover_counter = 0;
+   }
+   else if (load < low_load && current_limit < max_voices)
+   {
+      recover_counter += window;
+      if (recover_counter >= recover_frames)
+      {
+         current_limit++;
+         recover_counter = 0;
+      }
+   }
+   else
+      recover_counter = 0;
+
+   stats.limit.store(current_limit, memory_order_relaxed);
+   return current_limit;
+}
@@ -0,0 +1,76 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef GOVERNOR_HPP__
+#define GOVERNOR_HPP__
+
+#include <atomic>
+#include <chrono>
+
+// Adapts the number of voices to how much of the buffer period is spent rendering.
+// The voice limit drops quickly when the load gets too high, and recovers
+// one voice at a time once the load has stayed low for a while.
+class LoadGovernor
+{
+   public:
+      // Readable from any thread.
+      struct Stats
+      {
+         std::atomic<unsigned> limit{0};
+         std::atomic<unsigned> shed{0};
+         std::atomic<float> load{0.0f};
+         std::atomic<float> peak_load{0.0f};
+      };
+
+      // Fractions of the buffer period.
+      float high_load = 0.85f;
+      float target_load = 0.7f;
+      float low_load = 0.5f;
+
+      // How long the load must stay below low_load before adding a voice.
+      float recover_time = 0.25f;
+
+      void configure(unsigned sample_rate, unsigned period_frames, unsigned max_voices);
+
+      inline void begin()
+      {
+         start = std::chrono::steady_clock::now();
+      }
+
+      // Call after rendering frames. Returns the new voice limit.
+      unsigned end(unsigned frames, unsigned active_voices);
+
+      inline unsigned limit() const { return current_limit; }
+
+      // Counts voices which were shed to honor the limit.
+      inline void add_shed(unsigned voices) { stats.shed.fetch_add(voices, std::memory_order_relaxed); }
+
+      inline const Stats &get_stats() const { return stats; }
+
+   private:
+      std::chrono::steady_clock::time_point start;
+      double elapsed = 0.0;
+      unsigned frames = 0;
+      unsigned period_frames = 256;
+      unsigned recover_frames = 0;
+      unsigned recover_counter = 0;
+      float sample_rate = 44100.0f;
+      unsigned max_voices = 0;
+      unsigned current_limit = 0;
+      Stats stats;
+};
+
+#endif
@@ -1,15 +1,24 @@
 #include "audio_driver.hpp"
+#include "denormal.hpp"
+#include "recorder.hpp"
+#include "trace.hpp"
+#include "midi_queue.hpp"
+#include "lookahead.hpp"
+#include "realtime.hpp"
 #include <stdexcept>
 #include <cstdio>
+#include <algorithm>
+#include <thread>
 
 #include <jack/midiport.h>
 
 using namespace std;
 
-JACKDriver::JACKDriver(shared_ptr<AudioCallback> cb, unsigned channels)
-   : AudioDriver(move(cb))
+JACKDriver::JACKDriver(shared_ptr<AudioCallback> cb, unsigned channels, const string &record_path,
+      unsigned lookahead_ms, const string &trace_path)
+   : AudioDriver(move(cb)), channels(channels), lookahead_ms(lookahead_ms), queue(new MidiQueue)
 {
-   if (!init(channels))
+   if (!init(channels, record_path, trace_path))
    {
       term();
       throw runtime_error("Failed to initialize JACK.");
@@ -44,7 +53,22 @@ static int process_cb(jack_nframes_t nframes, void *data)
    return reinterpret_cast<JACKDriver*>(data)->process(nframes);
 }
 
-bool JACKDriver::init(unsigned channels)
+static int buffer_size_cb(jack_nframes_t nframes, void *data)
+{
+   return reinterpret_cast<JACKDriver*>(data)->buffer_size_changed(nframes);
+}
+
+static int sample_rate_cb(jack_nframes_t nframes, void *data)
+{
+   return reinterpret_cast<JACKDriver*>(data)->sample_rate_changed(nframes);
+}
+
+static int xrun_cb(void *data)
+{
+   return reinterpret_cast<JACKDriver*>(data)->xrun();
+}
+
+bool JACKDriver::init(unsigned channels, const string &record_path, const string &trace_path)
 {
    fprintf(stderr, "Initializing JACK ...\n");
    client = jack_client_open("AirSynth", JackNullOption, nullptr);
@@ -58,70 +82,261 @@ bool JACKDriver::init(unsigned channels)
       return false;
 
    jack_set_process_callback(client, process_cb, this);
+   jack_set_buffer_size_callback(client, buffer_size_cb, this);
+   jack_set_sample_rate_callback(client, sample_rate_cb, this);
 
-   for (unsigned c = 0; c < channels; c++)
+   // Ports of a bus are named after it, e.g. ch1_left, unless there is only one.
+   buses = audio_cb->buses();
+   for (unsigned b = 0; b < buses; b++)
    {
-      static const char *stereo_chans[] = { "left", "right" };
-      jack_port_t *port = jack_port_register(client, channels == 2 ? stereo_chans[c] : "output",
-            JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+      string prefix = buses > 1 ? audio_cb->bus_name(b) + "_" : "";
+      for (unsigned c = 0; c < channels; c++)
+      {
+         static const char *stereo_chans[] = { "left", "right" };
+         string name = prefix + (channels == 2 ? stereo_chans[c] : "output");
+         jack_port_t *port = jack_port_register(client, name.c_str(),
+               JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
 
-      if (!port)
-         return false;
+         if (!port)
+            return false;
 
-      audio_ports.push_back(port);
-      target_ptrs.push_back(nullptr);
+         audio_ports.push_back(port);
+         target_ptrs.push_back(nullptr);
+      }
    }
 
    midi_port = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
    if (!midi_port)
       return false;
 
-   auto max_frames = jack_get_buffer_size(client);
-   fprintf(stderr, "Got JACK buffer size: %u frames.\n", unsigned(max_frames));
-   unsigned sample_rate = jack_get_sample_rate(client);
-   fprintf(stderr, "Got JACK sample rate: %u Hz.\n", sample_rate);
-   audio_cb->configure_audio(sample_rate, channels);
-
    amps.insert(end(amps), channels, 1.0f);
 
+   if (!reconfigure(jack_get_sample_rate(client), jack_get_buffer_size(client)))
+      return false;
+
+   if (!record_path.empty())
+   {
+      try
+      {
+         recorder.reset(new Recorder(record_path, buses * channels, sample_rate));
+      }
+      catch (const exception &e)
+      {
+         fprintf(stderr, "%s\n", e.what());
+         return false;
+      }
+      fprintf(stderr, "Recording to %s.\n", record_path.c_str());
+   }
+
+   if (!trace_path.empty())
+   {
+      try
+      {
+         trace.reset(new TraceWriter(trace_path, channels, buses));
+      }
+      catch (const exception &e)
+      {
+         fprintf(stderr, "%s\n", e.what());
+         return false;
+      }
+      jack_set_xrun_callback(client, xrun_cb, this);
+      fprintf(stderr, "Tracing MIDI to %s.\n", trace_path.c_str());
+   }
+
    if (jack_activate(client) < 0)
       return false;
 
    return true;
 }
 
+bool JACKDriver::reconfigure(unsigned new_sample_rate, unsigned new_max_frames)
+{
+   lock_guard<mutex> hold(reconfigure_lock);
+   if (new_sample_rate == sample_rate && new_max_frames == max_frames)
+      return true;
+
+   // Both flags are sequentially consistent, so either process() sees reconfiguring
+   // and backs off, or this waits for the block it is already in to finish.
+   reconfiguring = true;
+   while (in_process)
+      this_thread::yield();
+
+   bool ok = true;
+   try
+   {
+      // The render thread plays the old configuration until it is gone.
+      lookahead.reset();
+
+      if (new_sample_rate != sample_rate)
+      {
+         fprintf(stderr, "Got JACK sample rate: %u Hz.\n", new_sample_rate);
+         audio_cb->configure_audio(new_sample_rate, channels);
+
+         // The file cannot change rate part-way through.
+         if (recorder)
+         {
+            fprintf(stderr, "Sample rate changed, recording stopped.\n");
+            recorder.reset();
+         }
+      }
+
+      fprintf(stderr, "Got JACK buffer size: %u frames.\n", new_max_frames);
+      audio_cb->configure_buffer_size(new_max_frames);
+
+      sample_rate = new_sample_rate;
+      max_frames = new_max_frames;
+
+      if (lookahead_ms)
+      {
+         // Blocks are at most half the look-ahead, so this leaves a full period ready.
+         unsigned frames = max(unsigned(uint64_t(lookahead_ms) * sample_rate / 1000), 2 * max_frames);
+         int priority = jack_is_realtime(client) ? max(jack_client_real_time_priority(client) - 1, 1) : -1;
+         lookahead.reset(new LookaheadRenderer(audio_cb, buses * channels, sample_rate, frames, priority));
+         fprintf(stderr, "Rendering %u frames (%.1f ms) ahead, in blocks of %u frames.\n",
+               lookahead->latency(), 1000.0 * lookahead->latency() / sample_rate, lookahead->block_frames());
+      }
+   }
+   catch (const exception &e)
+   {
+      fprintf(stderr, "Failed to reconfigure: %s\n", e.what());
+      ok = false;
+   }
+
+   // Audio stays silent if the new configuration could not be built.
+   if (ok)
+      reconfiguring = false;
+   return ok;
+}
+
+int JACKDriver::buffer_size_changed(jack_nframes_t frames)
+{
+   return reconfigure(sample_rate, frames) ? 0 : 1;
+}
+
+int JACKDriver::sample_rate_changed(jack_nframes_t rate)
+{
+   return reconfigure(rate, max_frames) ? 0 : 1;
+}
+
+int JACKDriver::xrun()
+{
+   xruns.fetch_add(1, memory_order_relaxed);
+   return 0;
+}
+
 int JACKDriver::process(jack_nframes_t frames)
 {
+   if (!stack_prefaulted)
+   {
+      RealTime::prefault_stack();
+      stack_prefaulted = true;
+   }
+
+   in_process = true;
+   if (reconfiguring)
+   {
+      in_process = false;
+      for (auto port : audio_ports)
+      {
+         auto buffer = static_cast<float*>(jack_port_get_buffer(port, frames));
+         fill(buffer, buffer + frames, 0.0f);
+      }
+      return 0;
+   }
+
+   render(frames);
+
+   in_process = false;
+   return 0;
+}
+
+void JACKDriver::render(jack_nframes_t frames)
+{
+   DenormalGuard denormal_guard;
+   AllocationCheck allocation_check;
+
+   if (trace)
+   {
+      trace->push_config(sample_rate, max_frames);
+      unsigned count = xruns.load(memory_order_relaxed);
+      if (count != traced_xruns)
+      {
+         trace->push(Trace::Record::Xrun, count - traced_xruns);
+         traced_xruns = count;
+      }
+   }
+
    void *midi = jack_port_get_buffer(midi_port, frames);
    auto events = jack_midi_get_event_count(midi);
 
+   // The callback writes every frame, so buffers are not cleared here.
    for (unsigned i = 0; i < target_ptrs.size(); i++)
-   {
       target_ptrs[i] = static_cast<float*>(jack_port_get_buffer(audio_ports[i], frames));
-      fill(target_ptrs[i], target_ptrs[i] + frames, 0.0f);
+
+   // Queued events are placed in the block by the time span it covers.
+   jack_nframes_t current_frames;
+   jack_time_t current_usecs, next_usecs;
+   float period_usecs;
+   if (jack_get_cycle_times(client, &current_frames, &current_usecs, &next_usecs, &period_usecs) < 0 ||
+         next_usecs <= current_usecs)
+   {
+      current_usecs = jack_get_time();
+      next_usecs = current_usecs + 1000000ull * frames / sample_rate;
    }
 
-   unsigned current_frame = 0;
-   for (unsigned i = 0; i < events; i++)
+   auto queued_frame = [&](uint64_t time) -> unsigned {
+      if (time <= current_usecs)
+         return 0;
+      return unsigned((time - current_usecs) * frames / (next_usecs - current_usecs));
+   };
+
+   // With look-ahead, events are handed on to the render thread instead.
+   auto deliver = [this](const AudioCallback::MidiEvent &event) {
+      if (trace)
+         trace->push_event(event);
+      if (lookahead)
+         lookahead->push_midi(event);
+      else
+         audio_cb->process_midi(event);
+   };
+
+   // Voices start and release at the event offsets,
+   // so the block is rendered in one go however dense the MIDI is.
+   // Both sources are in time order, port events go first on equal offsets.
+   unsigned index = 0;
+   jack_midi_event_t event;
+   bool port_pending = index < events && jack_midi_event_get(&event, midi, index) == 0;
+   for (;;)
    {
-      jack_midi_event_t event;
-      jack_midi_event_get(&event, midi, i);
+      auto queued = queue->peek();
+      if (queued && queued->time >= next_usecs)
+         queued = nullptr;
 
-      // Events can come in the "future". Events must be sorted in time.
-      if (event.time > current_frame)
+      if (port_pending && (!queued || event.time <= queued_frame(queued->time)))
       {
-         unsigned to_render = event.time - current_frame;
-         audio_cb->process_audio(target_ptrs.data(), amps.data(), to_render);
-         for (auto &ptr : target_ptrs)
-            ptr += to_render;
-         current_frame = event.time;
+         deliver(AudioCallback::get_event({event.buffer[0], event.buffer[1], event.buffer[2]},
+               min(unsigned(event.time), unsigned(frames) - 1)));
+         index++;
+         port_pending = index < events && jack_midi_event_get(&event, midi, index) == 0;
       }
-
-      audio_cb->process_midi({event.buffer[0], event.buffer[1], event.buffer[2]});
+      else if (queued)
+      {
+         auto queued_event = queued->event;
+         queued_event.frame = min(queued_frame(queued->time), unsigned(frames) - 1);
+         deliver(queued_event);
+         queue->pop();
+      }
+      else
+         break;
    }
 
-   audio_cb->process_audio(target_ptrs.data(), amps.data(), frames - current_frame);
-
-   return 0;
+   if (lookahead)
+      lookahead->read(target_ptrs.data(), frames);
+   else
+      audio_cb->process_buses(target_ptrs.data(), amps.data(), frames);
+   if (recorder)
+      recorder->push(target_ptrs.data(), frames);
+   if (trace)
+      trace->push(Trace::Record::Block, frames);
 }
 
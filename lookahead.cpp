@@ -0,0 +1,156 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "lookahead.hpp"
+#include "denormal.hpp"
+#include "realtime.hpp"
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+
+#include <pthread.h>
+#include <sched.h>
+
+using namespace std;
+
+LookaheadRenderer::LookaheadRenderer(shared_ptr<AudioCallback> cb, unsigned channels,
+      unsigned sample_rate, unsigned frames, int rt_priority)
+   : audio_cb(move(cb)), channels(channels), sample_rate(sample_rate), events(4096, 1)
+{
+   block = min_block_frames;
+   while (block * 2 <= frames / 2 && block < max_block_frames)
+      block <<= 1;
+   lookahead = max(frames, 2 * block);
+
+   capacity = 1;
+   while (capacity < lookahead + block)
+      capacity <<= 1;
+
+   // The output starts with lookahead frames of silence.
+   ring.resize(channels);
+   for (auto &buffer : ring)
+      buffer.resize(capacity);
+   write_pos = lookahead;
+
+   producer = events.add_producer();
+   audio_cb->configure_buffer_size(block);
+
+   thread = std::thread(&LookaheadRenderer::render_loop, this);
+   if (rt_priority >= 0)
+   {
+      sched_param param = {};
+      param.sched_priority = rt_priority;
+      if (pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &param) != 0)
+         fprintf(stderr, "[lookahead]: Failed to set SCHED_FIFO for render thread.\n");
+   }
+}
+
+LookaheadRenderer::~LookaheadRenderer()
+{
+   dead = true;
+   thread.join();
+
+   if (underruns())
+      fprintf(stderr, "[lookahead]: %llu underruns in total.\n",
+            static_cast<unsigned long long>(underruns()));
+}
+
+bool LookaheadRenderer::push_midi(const AudioCallback::MidiEvent &event)
+{
+   uint64_t time = read_pos.load(memory_order_relaxed) + event.frame + lookahead;
+   return producer->push(time, event);
+}
+
+void LookaheadRenderer::read(float **audio, unsigned frames)
+{
+   uint64_t pos = read_pos.load(memory_order_relaxed);
+   unsigned ready = unsigned(min(write_pos.load(memory_order_acquire) - pos, uint64_t(frames)));
+
+   for (unsigned c = 0; c < channels; c++)
+   {
+      const float *buffer = ring[c].data();
+      unsigned offset = unsigned(pos & (capacity - 1));
+      unsigned first = min(ready, unsigned(capacity - offset));
+      copy(buffer + offset, buffer + offset + first, audio[c]);
+      copy(buffer, buffer + (ready - first), audio[c] + first);
+      fill(audio[c] + ready, audio[c] + frames, 0.0f);
+   }
+
+   if (ready < frames)
+      underrun_count.store(underruns() + 1, memory_order_relaxed);
+
+   // Only what was played is consumed, so late audio is delayed rather than lost,
+   // and events stay in step with it.
+   read_pos.store(pos + ready, memory_order_release);
+}
+
+void LookaheadRenderer::render_loop()
+{
+   DenormalGuard denormal_guard;
+
+   vector<float*> outputs(channels);
+   vector<float> amps(channels, 1.0f);
+   uint64_t start = lookahead;
+   uint64_t reported = 0;
+   RealTime::prefault_stack();
+
+   while (!dead)
+   {
+      // Blocks end on multiples of the block size, so they never straddle the end
+      // of the ring. Only the first one can be short.
+      uint64_t end = (start / block + 1) * block;
+      unsigned frames = unsigned(end - start);
+
+      // Every event up to read_pos + lookahead has been pushed.
+      uint64_t known = read_pos.load(memory_order_acquire) + lookahead;
+      if (known < end)
+      {
+         uint64_t usecs = (end - known) * 1000000 / sample_rate;
+         this_thread::sleep_for(chrono::microseconds(max(usecs, uint64_t(500))));
+         continue;
+      }
+
+      // Neither MIDI nor rendering may touch the heap, see AllocationCheck.
+      {
+         AllocationCheck allocation_check;
+         while (auto event = events.peek())
+         {
+            if (event->time >= end)
+               break;
+            auto midi = event->event;
+            midi.frame = event->time > start ? unsigned(event->time - start) : 0;
+            audio_cb->process_midi(midi);
+            events.pop();
+         }
+
+         unsigned offset = unsigned(start & (capacity - 1));
+         for (unsigned c = 0; c < channels; c++)
+            outputs[c] = ring[c].data() + offset;
+         audio_cb->process_buses(outputs.data(), amps.data(), frames);
+      }
+
+      start = end;
+      write_pos.store(start, memory_order_release);
+
+      if (underruns() != reported)
+      {
+         reported = underruns();
+         fprintf(stderr, "[lookahead]: Render thread fell behind, %llu underruns so far.\n",
+               static_cast<unsigned long long>(reported));
+      }
+   }
+}
@@ -0,0 +1,93 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef LOOKAHEAD_HPP__
+#define LOOKAHEAD_HPP__
+
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include "audio_driver.hpp"
+#include "midi_queue.hpp"
+
+// Trades latency for headroom. A render thread runs the callback in large blocks,
+// ahead of a real-time driver, which only copies finished audio out of a ring.
+// MIDI received by the driver is delayed by the look-ahead, so event spacing is kept
+// exactly, just later.
+//
+// A block covering output frames [start, start + block) is rendered once every
+// event which can land in it has been received, so up to lookahead - block frames
+// are ready when it starts, and it has block frames worth of time to finish.
+class LookaheadRenderer
+{
+   public:
+      // Blocks are the largest power of two up to half the look-ahead, at most
+      // max_block_frames. channels counts the channels of every bus of the callback,
+      // which must already be configured.
+      // The render thread runs SCHED_FIFO at rt_priority unless it is negative.
+      LookaheadRenderer(std::shared_ptr<AudioCallback> cb, unsigned channels,
+            unsigned sample_rate, unsigned lookahead, int rt_priority);
+      ~LookaheadRenderer();
+
+      LookaheadRenderer(LookaheadRenderer&&) = delete;
+      void operator=(LookaheadRenderer&&) = delete;
+
+      enum { min_block_frames = 64, max_block_frames = 4096 };
+
+      inline unsigned block_frames() const { return block; }
+      inline unsigned latency() const { return lookahead; }
+
+      // Driver thread only, real-time safe.
+      // Queues an event at event.frame into the block the next read() returns.
+      // Returns false if the event queue is full.
+      bool push_midi(const AudioCallback::MidiEvent &event);
+      // Copies out frames of audio. Frames which are not rendered in time
+      // are silent, and the output falls behind by that much.
+      void read(float **audio, unsigned frames);
+
+      inline uint64_t underruns() const { return underrun_count.load(std::memory_order_relaxed); }
+
+   private:
+      std::shared_ptr<AudioCallback> audio_cb;
+      unsigned channels;
+      unsigned sample_rate;
+      unsigned block;
+      unsigned lookahead;
+
+      // Planar, capacity frames per channel, a power of two and at least lookahead + block.
+      std::vector<std::vector<float>> ring;
+      uint64_t capacity;
+
+      // Output frames since the start, each written by one thread only.
+      std::atomic<uint64_t> write_pos;
+      char padding[64];
+      std::atomic<uint64_t> read_pos{0};
+      std::atomic<uint64_t> underrun_count{0};
+
+      // Event times are in output frames.
+      MidiQueue events;
+      MidiQueue::Producer *producer;
+
+      std::atomic<bool> dead{false};
+      std::thread thread;
+
+      void render_loop();
+};
+
+#endif
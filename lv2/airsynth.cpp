@@ -90,12 +90,17 @@ class AirSynthVoice : public LV2::Voice
          if (m_key == LV2::INVALID_KEY)
             return;
 
-         float *buf[2] = { p(peg_output_left) + from, p(peg_output_right) + from };
-         for (unsigned i = 0; i < m_num_voices; i++)
+         // Voices render at most Voice::max_frames at a time, hosts may run larger blocks.
+         for (uint32_t offset = from; offset < to; offset += ::Voice::max_frames)
          {
-            float panning = clamp(*p(peg_pan0 + i), -1.0f, 1.0f);
-            float amp[2] = { min(1.0f - panning, 1.0f), min(1.0f + panning, 1.0f) };
-            m_voice[i].render(buf, amp, to - from, 2);
+            unsigned frames = min(to - offset, uint32_t(::Voice::max_frames));
+            float *buf[2] = { p(peg_output_left) + offset, p(peg_output_right) + offset };
+            for (unsigned i = 0; i < m_num_voices; i++)
+            {
+               float panning = clamp(*p(peg_pan0 + i), -1.0f, 1.0f);
+               float amp[2] = { min(1.0f - panning, 1.0f), min(1.0f + panning, 1.0f) };
+               m_voice[i].render(MixTarget(buf, amp, 2), frames);
+            }
          }
          if (!m_voice[0].active())
             m_key = LV2::INVALID_KEY;
@@ -130,6 +135,12 @@ class AirSynthLV2 : public LV2::Synth<VoiceType, AirSynthLV2<VoiceType>>
          this->add_audio_outputs(peg_output_left, peg_output_right);
       }
 
+      void run(uint32_t sample_count)
+      {
+         DenormalGuard denormal_guard;
+         LV2::Synth<VoiceType, AirSynthLV2<VoiceType>>::run(sample_count);
+      }
+
       void handle_midi(uint32_t size, unsigned char *data)
       {
          if (size != 3)
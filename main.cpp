@@ -18,15 +18,30 @@
 
 #include <cstdio>
 #include <cstdint>
+#include <cstdlib>
 #include <algorithm>
 #include <deque>
 #include <stdexcept>
 #include <utility>
 #include <functional>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
 
 #include <cstring>
+#include <cmath>
 #include <signal.h>
+#include <unistd.h>
 #include "synth.hpp"
+#include "note_render.hpp"
+#include "midi_file.hpp"
+#include "audio_sink.hpp"
+#include "server.hpp"
+#include "trace.hpp"
+#include "realtime.hpp"
+#include "midi_queue.hpp"
 
 using namespace std;
 
@@ -39,18 +54,178 @@ namespace Signal
    }
 }
 
+struct Options
+{
+   float silence_db = -96.0f;
+   float lod_db = -48.0f;
+   unsigned event_grid = 1;
+   StealPolicy steal_policy;
+   unsigned threads = 0;
+   int rt_priority = 60;
+   bool governor = false;
+
+   // Renders midi_file to output instead of running as a JACK client.
+   string output;
+   string midi_file;
+   unsigned sample_rate = 44100;
+   bool note_parallel = false;
+   string cache_dir;
+
+   // Serves render jobs on this Unix socket, see RenderServer.
+   string socket_path;
+
+   // Records the JACK output to this file.
+   string record_path;
+   // Plays this MIDI file under JACK, along with the MIDI port.
+   string play_path;
+
+   // Renders this far ahead of JACK on a thread of its own, 0 renders in the JACK callback.
+   unsigned lookahead_ms = 0;
+
+   // Splits the JACK output into a pair of ports per MIDI channel or program.
+   AirSynth::Routing routing = AirSynth::Routing::Mixed;
+
+   // Traces JACK MIDI and blocks to this file.
+   string trace_path;
+   // Replays a trace instead of running as a JACK client, to output if it is set.
+   string replay_path;
+   // Replays Trace::stress_script() instead of a trace file.
+   bool stress = false;
+
+   // Counts heap use on audio threads. Replays fail if any block allocates.
+   bool check_alloc = false;
+
+   // Streams MIDI from stdin to PCM on stdout instead of running as a JACK client.
+   bool pipe = false;
+   bool paced = false;
+   PipeDriver::Format format = PipeDriver::Format::Float;
+   unsigned block_frames = 4096;
+
+   // Initial program of each MIDI channel, which Program Change can switch later.
+   std::vector<std::pair<unsigned, unsigned>> parts;
+};
+
 static void print_help(void)
 {
-   fprintf(stderr, "Usage: airsynth [-o/--output <wav file>] [-h/--help]\n");
+   fprintf(stderr, "Usage: airsynth [-o/--output <wav file> [-R/--rate <Hz>] [-n/--notes [-C/--cache <dir>]] <midi file>] [-S/--serve <socket> [-R/--rate <Hz>]]\n"
+         "\t[-P/--pipe [-R/--rate <Hz>] [-F/--format <float|int16>] [-t/--paced] [-b/--block <frames>]] [-s/--silence <dB>] [-l/--lod <dB>] [-p/--steal <policy>]\n"
+         "\t[-q/--quantize <frames>] [-i/--instrument <channel>=<type>] [-j/--threads <threads>] [-r/--priority <priority>] [-g/--governor] [-w/--record <file>] [-L/--lookahead <ms>]\n"
+         "\t[-m/--play <midi file>] [-B/--buses <mixed|channel|program>] [-T/--trace <file>] [-x/--replay <file> [-o/--output <wav file>]] [-X/--stress] [-A/--check-alloc] [-h/--help]\n");
+   fprintf(stderr, "\t--output renders a Standard MIDI File to a WAV file as fast as possible, without JACK. --rate defaults to 44100.\n");
+   fprintf(stderr, "\t--notes renders every note as its own job on --threads threads, all cores by default.\n"
+         "\t\tNotes do not steal voices from each other, and pitch bend and modulation are ignored.\n"
+         "\t\tRepeated notes are rendered once. --cache also keeps rendered notes in dir for later runs.\n");
+   fprintf(stderr, "\t--serve renders MIDI files sent to a Unix socket, on --threads jobs at once, one per core by default.\n"
+         "\t\t--rate is the default sample rate of jobs.\n");
+   fprintf(stderr, "\t--pipe reads MIDI events from stdin and writes interleaved stereo PCM to stdout, float by default.\n"
+         "\t\tEvents are 8 bytes: frames since the previous event (uint32, little endian), 3 MIDI bytes and 1 unused byte.\n"
+         "\t\t--paced writes no faster than real time and never waits for input. --block defaults to 4096 frames.\n");
+   fprintf(stderr, "\t--lod renders voices quieter than this at reduced quality, -inf to disable.\n");
+   fprintf(stderr, "\t--quantize rounds MIDI event times down to a multiple of frames. Events are sample accurate by default.\n");
+   fprintf(stderr, "\t--instrument sets the initial program of MIDI channel 1 to 16 to noise (0), sawtooth (1) or square (2).\n"
+         "\t\tDefaults to noise. Program Change messages switch programs while playing.\n");
+   fprintf(stderr, "\t<policy> is oldest or quietest, optionally followed by ,same-note and/or ,released.\n");
+   fprintf(stderr, "\t--threads renders voices on this many threads. --priority sets their SCHED_FIFO priority, -1 to disable.\n");
+   fprintf(stderr, "\t--governor limits polyphony to what the CPU can render within the JACK period.\n");
+   fprintf(stderr, "\t--record writes everything played to a WAV file, or FLAC if file ends in .flac.\n");
+   fprintf(stderr, "\t--play plays a Standard MIDI File under JACK, mixed in time with the events of the MIDI port.\n");
+   fprintf(stderr, "\t--lookahead renders in large blocks on a thread of its own, ms ahead of JACK, for more polyphony\n"
+         "\t\tat the cost of latency. MIDI is delayed by as much.\n");
+   fprintf(stderr, "\t--buses gives every MIDI channel, or every program, ports of its own instead of mixing everything.\n");
+   fprintf(stderr, "\t--trace logs every MIDI event and block played under JACK, for --replay. Not with --lookahead.\n"
+         "\t--replay renders the blocks and events of a trace as fast as possible and reports how long each took.\n"
+         "\t\tGive the options the trace was made with, except --governor, which is ignored. --output also writes the audio.\n");
+   fprintf(stderr, "\t--stress replays a built-in script of dense MIDI on every channel, in blocks of several sizes, like --replay.\n");
+   fprintf(stderr, "\t--check-alloc counts heap allocations on audio threads under JACK, --replay or --stress. A replay which allocates fails.\n");
 }
 
-static void parse_cmdline(int argc, char *argv[])
+static bool parse_steal_policy(const char *arg, StealPolicy &policy)
 {
+   policy.same_note_first = false;
+   policy.released_first = false;
+
+   string str = arg;
+   size_t pos = 0;
+   while (pos <= str.size())
+   {
+      size_t end = str.find(',', pos);
+      if (end == string::npos)
+         end = str.size();
+      auto word = str.substr(pos, end - pos);
+
+      if (word == "oldest")
+         policy.order = StealPolicy::Order::Oldest;
+      else if (word == "quietest")
+         policy.order = StealPolicy::Order::Quietest;
+      else if (word == "same-note")
+         policy.same_note_first = true;
+      else if (word == "released")
+         policy.released_first = true;
+      else
+         return false;
+
+      pos = end + 1;
+   }
+
+   return true;
+}
+
+static bool parse_part(const char *arg, Options &options)
+{
+   char *end = nullptr;
+   unsigned long channel = strtoul(arg, &end, 0);
+   if (end == arg || *end != '=' || channel < 1 || channel > Synthesizer::num_midi_channels)
+      return false;
+
+   string type = end + 1;
+   unsigned program;
+   if (type == "noise")
+      program = 0;
+   else if (type == "sawtooth")
+      program = 1;
+   else if (type == "square")
+      program = 2;
+   else
+      return false;
+
+   options.parts.push_back({unsigned(channel - 1), program});
+   return true;
+}
+
+static Options parse_cmdline(int argc, char *argv[])
+{
+   Options options;
    const struct option opts[] = {
       { "help", 0, NULL, 'h' },
+      { "output", 1, NULL, 'o' },
+      { "rate", 1, NULL, 'R' },
+      { "notes", 0, NULL, 'n' },
+      { "cache", 1, NULL, 'C' },
+      { "serve", 1, NULL, 'S' },
+      { "pipe", 0, NULL, 'P' },
+      { "format", 1, NULL, 'F' },
+      { "paced", 0, NULL, 't' },
+      { "block", 1, NULL, 'b' },
+      { "silence", 1, NULL, 's' },
+      { "lod", 1, NULL, 'l' },
+      { "steal", 1, NULL, 'p' },
+      { "quantize", 1, NULL, 'q' },
+      { "instrument", 1, NULL, 'i' },
+      { "threads", 1, NULL, 'j' },
+      { "priority", 1, NULL, 'r' },
+      { "governor", 0, NULL, 'g' },
+      { "record", 1, NULL, 'w' },
+      { "play", 1, NULL, 'm' },
+      { "lookahead", 1, NULL, 'L' },
+      { "buses", 1, NULL, 'B' },
+      { "trace", 1, NULL, 'T' },
+      { "replay", 1, NULL, 'x' },
+      { "stress", 0, NULL, 'X' },
+      { "check-alloc", 0, NULL, 'A' },
+      { NULL, 0, NULL, 0 },
    };
 
-   const char *optstring = "h";
+   const char *optstring = "ho:R:nC:S:PF:tb:s:l:p:q:i:j:r:gw:m:L:B:T:x:XA";
    for (;;)
    {
       int c = getopt_long(argc, argv, optstring, opts, NULL);
@@ -64,17 +239,216 @@ static void parse_cmdline(int argc, char *argv[])
             exit(EXIT_SUCCESS);
             break;
 
+         case 'o':
+            options.output = optarg;
+            break;
+
+         case 'R':
+            options.sample_rate = strtoul(optarg, nullptr, 0);
+            break;
+
+         case 'n':
+            options.note_parallel = true;
+            break;
+
+         case 'C':
+            options.cache_dir = optarg;
+            break;
+
+         case 'S':
+            options.socket_path = optarg;
+            break;
+
+         case 'P':
+            options.pipe = true;
+            break;
+
+         case 'F':
+            if (!strcmp(optarg, "float"))
+               options.format = PipeDriver::Format::Float;
+            else if (!strcmp(optarg, "int16"))
+               options.format = PipeDriver::Format::Int16;
+            else
+            {
+               print_help();
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 't':
+            options.paced = true;
+            break;
+
+         case 'b':
+            options.block_frames = strtoul(optarg, nullptr, 0);
+            break;
+
+         case 's':
+            options.silence_db = strtof(optarg, nullptr);
+            break;
+
+         case 'l':
+            options.lod_db = strtof(optarg, nullptr);
+            break;
+
+         case 'p':
+            if (!parse_steal_policy(optarg, options.steal_policy))
+            {
+               print_help();
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 'q':
+            options.event_grid = strtoul(optarg, nullptr, 0);
+            break;
+
+         case 'i':
+            if (!parse_part(optarg, options))
+            {
+               print_help();
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 'j':
+            options.threads = strtoul(optarg, nullptr, 0);
+            break;
+
+         case 'r':
+            options.rt_priority = strtol(optarg, nullptr, 0);
+            break;
+
+         case 'g':
+            options.governor = true;
+            break;
+
+         case 'w':
+            options.record_path = optarg;
+            break;
+
+         case 'm':
+            options.play_path = optarg;
+            break;
+
+         case 'L':
+            options.lookahead_ms = strtoul(optarg, nullptr, 0);
+            break;
+
+         case 'T':
+            options.trace_path = optarg;
+            break;
+
+         case 'x':
+            options.replay_path = optarg;
+            break;
+
+         case 'X':
+            options.stress = true;
+            break;
+
+         case 'A':
+            options.check_alloc = true;
+            break;
+
+         case 'B':
+            if (!strcmp(optarg, "mixed"))
+               options.routing = AirSynth::Routing::Mixed;
+            else if (!strcmp(optarg, "channel"))
+               options.routing = AirSynth::Routing::Channel;
+            else if (!strcmp(optarg, "program"))
+               options.routing = AirSynth::Routing::Program;
+            else
+            {
+               print_help();
+               exit(EXIT_FAILURE);
+            }
+            break;
+
          case '?':
             print_help();
             exit(EXIT_FAILURE);
       }
    }
 
-   if (optind < argc)
+   bool replaying = options.stress || !options.replay_path.empty();
+   if (!options.output.empty() && !replaying && optind + 1 == argc && options.sample_rate)
+      options.midi_file = argv[optind++];
+
+   if (optind < argc || (!options.output.empty() && options.midi_file.empty() && !replaying) ||
+         (options.note_parallel && options.output.empty()) ||
+         (!options.cache_dir.empty() && !options.note_parallel) ||
+         (!options.socket_path.empty() && !options.output.empty()) || !options.sample_rate ||
+         ((!options.record_path.empty() || options.lookahead_ms || !options.trace_path.empty() ||
+           !options.play_path.empty()) &&
+          (!options.output.empty() || !options.socket_path.empty() || options.pipe || replaying)) ||
+         (options.lookahead_ms && !options.trace_path.empty()) ||
+         (options.routing != AirSynth::Routing::Mixed &&
+          ((!options.output.empty() && !replaying) || !options.socket_path.empty() || options.pipe)) ||
+         (replaying && (!options.socket_path.empty() || options.pipe || options.note_parallel)) ||
+         (options.stress && !options.replay_path.empty()) ||
+         (options.check_alloc && !replaying &&
+          (!options.output.empty() || !options.socket_path.empty() || options.pipe)) ||
+         (options.pipe && (!options.output.empty() || !options.socket_path.empty() || !options.block_frames)))
    {
       print_help();
       exit(EXIT_FAILURE);
    }
+
+   return options;
+}
+
+// Prints changes to the voice limit and voices shed by the load governor.
+static void monitor_governor(const AirSynth &synth, const atomic<bool> &quit)
+{
+   auto &stats = synth.governor_stats();
+   unsigned last_limit = 0;
+   unsigned last_shed = 0;
+
+   while (!quit)
+   {
+      this_thread::sleep_for(chrono::milliseconds(500));
+
+      unsigned limit = stats.limit.load();
+      unsigned shed = stats.shed.load();
+      if (limit == last_limit && shed == last_shed)
+         continue;
+
+      fprintf(stderr, "[governor]: Voice limit %u, load %.0f %% (peak %.0f %%), %u voices shed in total.\n",
+            limit, 100.0f * stats.load.load(), 100.0f * stats.peak_load.load(), shed);
+      last_limit = limit;
+      last_shed = shed;
+   }
+}
+
+// Hands the events of a MIDI file to the audio thread through the MIDI queue of the
+// driver, timestamped ahead of time, so they play on their exact frames.
+static void play_midi(JACKDriver &driver, MidiFile &midi, const atomic<bool> &quit)
+{
+   auto producer = driver.midi_queue().add_producer();
+   if (!producer)
+   {
+      fprintf(stderr, "No MIDI queue left to play from.\n");
+      return;
+   }
+
+   // Gives the first events time to be drained before they are due.
+   uint64_t start = JACKDriver::now() + 100000;
+
+   MidiFile::Event event;
+   while (!quit && midi.next(event))
+   {
+      uint64_t time = start + uint64_t(llround(event.time * 1e6));
+      auto midi_event = AudioCallback::get_event(event.data);
+
+      // The ring fills up far ahead of time, wait for the audio thread to catch up.
+      while (!producer->push(time, midi_event))
+      {
+         if (quit)
+            return;
+         this_thread::sleep_for(chrono::milliseconds(10));
+      }
+   }
 }
 
 static void register_signals(std::function<void ()> func)
@@ -92,19 +466,194 @@ static void register_signals(std::function<void ()> func)
 
 int main(int argc, char *argv[])
 {
-   parse_cmdline(argc, argv);
+   auto options = parse_cmdline(argc, argv);
 
    try
    {
-      shared_ptr<Synthesizer> synth = make_shared<AirSynth>();
-      auto audio_driver = make_shared<JACKDriver>(synth, 2);
+      auto make_synth = [&options] {
+         auto synth = make_shared<AirSynth>();
+         for (auto &part : options.parts)
+            synth->set_program(part.first, part.second);
+
+         synth->set_silence_threshold(options.silence_db);
+         synth->set_lod_threshold(options.lod_db);
+         synth->set_steal_policy(options.steal_policy);
+         synth->set_event_grid(options.event_grid);
+         return synth;
+      };
+
+      if (!options.socket_path.empty())
+      {
+         // Jobs run in parallel rather than voices, every synth renders on its worker alone.
+         if (options.governor)
+            fprintf(stderr, "Ignoring --governor when serving.\n");
+
+         unsigned workers = options.threads ? options.threads : max(thread::hardware_concurrency(), 1u);
+         RenderServer server(options.socket_path, workers, options.sample_rate, make_synth);
+         register_signals([&server] {
+            server.stop();
+         });
+         server.run();
+         return EXIT_SUCCESS;
+      }
+
+      auto synth = make_synth();
+
+      if (options.pipe)
+      {
+         // Data goes to stdout, so nothing else may. A closed pipe ends the stream.
+         if (options.governor)
+            fprintf(stderr, "Ignoring --governor when streaming.\n");
+         signal(SIGPIPE, SIG_IGN);
+
+         synth->set_threads(options.threads, -1);
+         PipeDriver driver(synth, STDIN_FILENO, STDOUT_FILENO, 2, options.sample_rate,
+               options.format, options.paced, options.block_frames);
+         register_signals([&driver] {
+            driver.stop();
+         });
+         uint64_t frames = driver.render();
+         fprintf(stderr, "Streamed %.1f s of audio.\n", double(frames) / options.sample_rate);
+         return EXIT_SUCCESS;
+      }
+
+      if (!options.replay_path.empty() || options.stress)
+      {
+         // The governor reacts to timing, so it would change the workload from run to run.
+         if (options.governor)
+            fprintf(stderr, "Ignoring --governor when replaying.\n");
+
+         synth->set_threads(options.threads, -1);
+         synth->set_routing(options.routing);
+
+         unique_ptr<TraceReader> trace_reader(options.stress ?
+               new TraceReader(Trace::stress_script(2, synth->buses())) :
+               new TraceReader(options.replay_path));
+         auto &trace = *trace_reader;
+         unique_ptr<SndfileSink> sink;
+         if (!options.output.empty())
+         {
+            unsigned rate = trace.sample_rate() ? trace.sample_rate() : options.sample_rate;
+            sink.reset(new SndfileSink(options.output, synth->buses() * trace.channels(), rate));
+         }
+
+         ReplayDriver driver(synth, trace, sink.get());
+         register_signals([&driver] {
+            driver.stop();
+         });
+         AllocationCheck::enable(options.check_alloc);
+
+         auto result = driver.render();
+         double length = trace.sample_rate() ? double(result.frames) / trace.sample_rate() : 0.0;
+         fprintf(stderr, "Replayed %llu blocks, %.1f s of audio, in %.2f s.\n",
+               static_cast<unsigned long long>(result.blocks), length, result.seconds);
+         fprintf(stderr, "%llu blocks took longer than their period. The worst, block %llu at %.3f s, took %.0f %% of it.\n",
+               static_cast<unsigned long long>(result.late_blocks),
+               static_cast<unsigned long long>(result.worst_block),
+               trace.sample_rate() ? double(result.worst_frame) / trace.sample_rate() : 0.0,
+               100.0 * result.worst_load);
+         if (result.xruns)
+            fprintf(stderr, "%u xruns were reported live.\n", result.xruns);
+
+         DenormalCounter::report();
+
+         if (options.check_alloc)
+         {
+            if (result.allocating_blocks)
+            {
+               fprintf(stderr, "%llu blocks touched the heap, the first was block %llu.\n",
+                     static_cast<unsigned long long>(result.allocating_blocks),
+                     static_cast<unsigned long long>(result.first_allocating_block));
+               return EXIT_FAILURE;
+            }
+            fprintf(stderr, "No block touched the heap.\n");
+         }
+         return EXIT_SUCCESS;
+      }
+
+      if (!options.output.empty())
+      {
+         // Offline rendering has no deadline, so neither real-time
+         // priority nor the governor apply.
+         if (options.governor)
+            fprintf(stderr, "Ignoring --governor when rendering offline.\n");
+
+         if (options.note_parallel)
+         {
+            // 256 MiB of notes in memory, 1 GiB on disk.
+            auto cache = make_shared<NoteCache>(size_t(256) << 20, options.cache_dir, size_t(1) << 30);
+            NoteRenderer renderer(synth, options.midi_file, options.output,
+                  options.sample_rate, options.threads, cache);
+            register_signals([&renderer] {
+               renderer.stop();
+            });
+            renderer.render();
+            return EXIT_SUCCESS;
+         }
+
+         synth->set_threads(options.threads, -1);
+
+         MidiFile midi(options.midi_file);
+         SndfileSink sink(options.output, 2, options.sample_rate);
+         OfflineDriver driver(synth, midi, sink, 2, options.sample_rate);
+         register_signals([&driver] {
+            driver.stop();
+         });
+
+         auto start = chrono::steady_clock::now();
+         auto result = driver.render();
+         double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+         double length = double(result.frames) / options.sample_rate;
+         fprintf(stderr, "Rendered %.1f s (%.1f s with voices) in %.2f s, %.1fx real time.\n",
+               length, double(result.rendered) / options.sample_rate, elapsed,
+               length / max(elapsed, 1e-6));
+
+         DenormalCounter::report();
+         return EXIT_SUCCESS;
+      }
+
+      synth->set_threads(options.threads, options.rt_priority);
+      synth->enable_governor(options.governor);
+      synth->set_routing(options.routing);
+      AllocationCheck::enable(options.check_alloc);
+
+      // Opened before JACK, so a bad file fails at once.
+      unique_ptr<MidiFile> midi;
+      if (!options.play_path.empty())
+         midi.reset(new MidiFile(options.play_path));
+
+      auto audio_driver = make_shared<JACKDriver>(synth, 2, options.record_path, options.lookahead_ms,
+            options.trace_path);
+
+      // Everything the audio threads use exists by now. Keep it from faulting in mid-performance.
+      if (!RealTime::lock_memory())
+         RealTime::prefault_memory();
 
       register_signals([&audio_driver] {
          audio_driver->kill();
       });
 
+      atomic<bool> quit{false};
+      thread monitor;
+      if (options.governor)
+         monitor = thread(monitor_governor, cref(*synth), cref(quit));
+
+      thread player;
+      if (midi)
+         player = thread(play_midi, ref(*audio_driver), ref(*midi), cref(quit));
+
       audio_driver->run();
 
+      quit = true;
+      if (monitor.joinable())
+         monitor.join();
+      if (player.joinable())
+         player.join();
+
+      DenormalCounter::report();
+      if (options.check_alloc)
+         fprintf(stderr, "Audio threads touched the heap %llu times.\n",
+               static_cast<unsigned long long>(AllocationCheck::count()));
       fprintf(stderr, "Quitting ...\n");
       return EXIT_SUCCESS;
    }
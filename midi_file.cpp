@@ -0,0 +1,243 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "midi_file.hpp"
+#include <stdexcept>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static inline unsigned read_be(const uint8_t *data, unsigned bytes)
+{
+   unsigned value = 0;
+   for (unsigned i = 0; i < bytes; i++)
+      value = (value << 8) | data[i];
+   return value;
+}
+
+// Variable length quantity, at most four bytes.
+static bool read_vlq(const uint8_t *&ptr, const uint8_t *end, unsigned &value)
+{
+   value = 0;
+   for (unsigned i = 0; i < 4 && ptr < end; i++)
+   {
+      uint8_t byte = *ptr++;
+      value = (value << 7) | (byte & 0x7f);
+      if (!(byte & 0x80))
+         return true;
+   }
+   return false;
+}
+
+MidiFile::MidiFile(const string &path)
+{
+   int fd = open(path.c_str(), O_RDONLY);
+   if (fd < 0)
+      throw runtime_error("Failed to open MIDI file " + path);
+
+   struct stat st;
+   if (fstat(fd, &st) < 0 || st.st_size < 14)
+   {
+      close(fd);
+      throw runtime_error("Invalid MIDI file " + path);
+   }
+
+   map_size = st.st_size;
+   void *addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (addr == MAP_FAILED)
+      throw runtime_error("Failed to map MIDI file " + path);
+
+   map = static_cast<const uint8_t*>(addr);
+   mapped = true;
+   madvise(addr, map_size, MADV_SEQUENTIAL);
+
+   try
+   {
+      parse(path);
+   }
+   catch (...)
+   {
+      munmap(addr, map_size);
+      throw;
+   }
+}
+
+MidiFile::MidiFile(const void *data, size_t size)
+   : map(static_cast<const uint8_t*>(data)), map_size(size)
+{
+   if (size < 14)
+      throw runtime_error("Invalid MIDI file <memory>");
+   parse("<memory>");
+}
+
+MidiFile::~MidiFile()
+{
+   if (mapped)
+      munmap(const_cast<uint8_t*>(map), map_size);
+}
+
+void MidiFile::parse(const string &name)
+{
+   const uint8_t *ptr = map;
+   const uint8_t *end = map + map_size;
+   unsigned header_len = read_be(ptr + 4, 4);
+   if (memcmp(ptr, "MThd", 4) || header_len < 6 || header_len > map_size - 8)
+      throw runtime_error("Not a Standard MIDI File: " + name);
+
+   unsigned format = read_be(ptr + 8, 2);
+   unsigned num_tracks = read_be(ptr + 10, 2);
+   division = read_be(ptr + 12, 2);
+   if (format > 1 || division == 0)
+      throw runtime_error("Unsupported MIDI file format in " + name);
+
+   if (division & 0x8000)
+   {
+      // SMPTE time: frames per second, and ticks per frame.
+      // The 29.97 fps format (-29) is close enough to 30 for a synth.
+      unsigned fps = 256 - (division >> 8);
+      unsigned ticks_per_frame = division & 0xff;
+      seconds_per_tick = 1.0 / (fps * max(ticks_per_frame, 1u));
+   }
+   else
+      set_tempo(0, 500000); // 120 BPM until told otherwise.
+
+   // Unknown chunks are skipped, truncated tracks play up to where they end.
+   ptr += 8 + header_len;
+   while (tracks.size() < num_tracks && end - ptr >= 8)
+   {
+      size_t len = min(size_t(read_be(ptr + 4, 4)), size_t(end - ptr - 8));
+      if (!memcmp(ptr, "MTrk", 4))
+      {
+         Track track = { ptr + 8, ptr + 8 + len, 0, 0 };
+         if (read_delta(track))
+            tracks.push_back(track);
+      }
+      ptr += 8 + len;
+   }
+}
+
+bool MidiFile::read_delta(Track &track)
+{
+   unsigned delta;
+   if (!read_vlq(track.ptr, track.end, delta))
+      return false;
+   track.tick += delta;
+   return true;
+}
+
+void MidiFile::set_tempo(uint64_t tick, unsigned usecs_per_quarter)
+{
+   if (division & 0x8000)
+      return;
+
+   tempo_time += (tick - tempo_tick) * seconds_per_tick;
+   tempo_tick = tick;
+   seconds_per_tick = usecs_per_quarter * 1e-6 / division;
+}
+
+bool MidiFile::next(Event &event)
+{
+   while (!tracks.empty())
+   {
+      // Format 1 files have few tracks, a linear scan beats a heap.
+      // Ties go to the earlier track, which holds the tempo map.
+      auto track_itr = begin(tracks);
+      for (auto itr = begin(tracks); itr != end(tracks); ++itr)
+         if (itr->tick < track_itr->tick)
+            track_itr = itr;
+
+      auto &track = *track_itr;
+      uint64_t tick = track.tick;
+      bool channel_event = false;
+
+      uint8_t status = track.ptr < track.end ? *track.ptr : 0;
+      if (status & 0x80)
+         track.ptr++;
+      else
+         status = track.status; // Running status
+
+      if (status >= 0x80 && status < 0xf0)
+      {
+         unsigned bytes = (status & 0xe0) == 0xc0 ? 1 : 2;
+         if (track.end - track.ptr < ptrdiff_t(bytes))
+         {
+            tracks.erase(track_itr);
+            continue;
+         }
+
+         event.data[0] = status;
+         event.data[1] = track.ptr[0] & 0x7f;
+         event.data[2] = bytes == 2 ? track.ptr[1] & 0x7f : 0;
+         event.time = tempo_time + (tick - tempo_tick) * seconds_per_tick;
+
+         track.ptr += bytes;
+         track.status = status;
+         channel_event = true;
+      }
+      else if (status == 0xff && track.ptr < track.end)
+      {
+         uint8_t type = *track.ptr++;
+         unsigned len;
+         if (!read_vlq(track.ptr, track.end, len) || len > size_t(track.end - track.ptr))
+         {
+            tracks.erase(track_itr);
+            continue;
+         }
+
+         if (type == 0x2f) // End of track
+         {
+            tracks.erase(track_itr);
+            continue;
+         }
+         else if (type == 0x51 && len == 3)
+            set_tempo(tick, read_be(track.ptr, 3));
+
+         track.ptr += len;
+         track.status = 0;
+      }
+      else if (status == 0xf0 || status == 0xf7)
+      {
+         unsigned len;
+         if (!read_vlq(track.ptr, track.end, len) || len > size_t(track.end - track.ptr))
+         {
+            tracks.erase(track_itr);
+            continue;
+         }
+         track.ptr += len;
+         track.status = 0;
+      }
+      else
+      {
+         // Garbage, or data bytes without running status.
+         tracks.erase(track_itr);
+         continue;
+      }
+
+      if (!read_delta(track))
+         tracks.erase(track_itr);
+
+      if (channel_event)
+         return true;
+   }
+
+   return false;
+}
@@ -0,0 +1,74 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MIDI_FILE_HPP__
+#define MIDI_FILE_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "audio_driver.hpp"
+
+// Reads a Standard MIDI File, format 0 or 1. The file is mapped into memory
+// and tracks are decoded in place as events are read, nothing is copied up front.
+class MidiFile
+{
+   public:
+      MidiFile(const std::string &path);
+      // Reads a file which is already in memory. data must outlive the MidiFile.
+      MidiFile(const void *data, size_t size);
+      ~MidiFile();
+
+      MidiFile(MidiFile&&) = delete;
+      void operator=(MidiFile&&) = delete;
+
+      struct Event
+      {
+         // Seconds from the start of the file, following tempo changes.
+         double time;
+         AudioCallback::MidiRawData data;
+      };
+
+      // Channel events of all tracks in time order. Meta and system exclusive
+      // events are consumed internally. Returns false at the end of the file.
+      bool next(Event &event);
+
+   private:
+      const uint8_t *map = nullptr;
+      size_t map_size = 0;
+      bool mapped = false;
+
+      struct Track
+      {
+         const uint8_t *ptr;
+         const uint8_t *end;
+         uint64_t tick;
+         uint8_t status;
+      };
+      std::vector<Track> tracks;
+
+      unsigned division = 0;
+      double seconds_per_tick = 0.0;
+      uint64_t tempo_tick = 0;
+      double tempo_time = 0.0;
+
+      void parse(const std::string &name);
+      bool read_delta(Track &track);
+      void set_tempo(uint64_t tick, unsigned usecs_per_quarter);
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "midi_queue.hpp"
+#include <algorithm>
+
+using namespace std;
+
+MidiQueue::MidiQueue(unsigned capacity, unsigned count)
+   : producers(min(max(count, 1u), unsigned(max_producers)))
+{
+   uint64_t size = 1;
+   while (size < capacity)
+      size <<= 1;
+
+   for (unsigned i = 0; i < producers.size(); i++)
+   {
+      producers[i].slots.resize(size);
+      producers[i].mask = size - 1;
+   }
+}
+
+MidiQueue::Producer *MidiQueue::add_producer()
+{
+   unsigned index = claimed.fetch_add(1, memory_order_relaxed);
+   return index < producers.size() ? &producers[index] : nullptr;
+}
+
+const MidiQueue::Event *MidiQueue::peek()
+{
+   unsigned count = min(claimed.load(memory_order_relaxed), unsigned(producers.size()));
+
+   // Producers are few, so a scan of their oldest events beats any heap.
+   // On equal times, earlier producers go first.
+   const Event *earliest = nullptr;
+   peeked = nullptr;
+   for (unsigned i = 0; i < count; i++)
+   {
+      const Event *event = producers[i].front();
+      if (event && (!earliest || event->time < earliest->time))
+      {
+         earliest = event;
+         peeked = &producers[i];
+      }
+   }
+   return earliest;
+}
+
+void MidiQueue::pop()
+{
+   if (!peeked)
+      return;
+   peeked->read_pos.store(peeked->read_pos.load(memory_order_relaxed) + 1, memory_order_release);
+   peeked = nullptr;
+}
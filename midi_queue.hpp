@@ -0,0 +1,105 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef MIDI_QUEUE_HPP__
+#define MIDI_QUEUE_HPP__
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include "audio_driver.hpp"
+#include "aligned.hpp"
+
+// Timestamped MIDI events from any number of non-real-time threads to the audio thread.
+// Every producer owns a single-producer, single-consumer ring, so pushing and draining
+// are both wait-free and never allocate. The audio thread sees the events of all
+// producers merged in time order.
+class MidiQueue
+{
+   public:
+      struct Event
+      {
+         // In the clock of the driver which drains the queue. 0 is as soon as possible.
+         uint64_t time = 0;
+         AudioCallback::MidiEvent event{AudioCallback::Event::None, 0, 0, 0};
+      };
+
+      class Producer
+      {
+         public:
+            // Events of one producer must be pushed in time order.
+            // Returns false, and drops the event, if the ring is full.
+            inline bool push(uint64_t time, const AudioCallback::MidiEvent &event)
+            {
+               uint64_t pos = write_pos.load(std::memory_order_relaxed);
+               if (pos - read_pos.load(std::memory_order_acquire) > mask)
+                  return false;
+
+               auto &slot = slots[pos & mask];
+               slot.time = time;
+               slot.event = event;
+               write_pos.store(pos + 1, std::memory_order_release);
+               return true;
+            }
+
+         private:
+            friend class MidiQueue;
+
+            // Each cursor has a cache line of its own, written by one thread only, and
+            // the ring, which both read, is kept apart from them. Producers start on
+            // cache lines in the AlignedArray, so nothing is shared with a neighbour.
+            alignas(64) std::atomic<uint64_t> write_pos{0};
+            alignas(64) std::atomic<uint64_t> read_pos{0};
+            alignas(64) std::vector<Event> slots;
+            uint64_t mask = 0;
+
+            inline const Event *front() const
+            {
+               uint64_t pos = read_pos.load(std::memory_order_relaxed);
+               if (pos == write_pos.load(std::memory_order_acquire))
+                  return nullptr;
+               return &slots[pos & mask];
+            }
+      };
+
+      enum { max_producers = 16 };
+
+      // Every producer can hold capacity events, rounded up to a power of two.
+      // Rings for producers producers are allocated up front, at most max_producers.
+      explicit MidiQueue(unsigned capacity = 1024, unsigned producers = max_producers);
+
+      MidiQueue(MidiQueue&&) = delete;
+      void operator=(MidiQueue&&) = delete;
+
+      // Hands out a producer for one thread, which owns it for as long as the queue lives.
+      // Wait-free, null once all producers are taken.
+      Producer *add_producer();
+
+      // Audio thread only. The earliest event of all producers, or null if all are empty.
+      const Event *peek();
+      // Removes the event returned by the last peek().
+      void pop();
+
+   private:
+      static_assert(sizeof(Producer) % AlignedArray<Producer>::alignment == 0,
+            "Producers must not share cache lines.");
+      AlignedArray<Producer> producers;
+      std::atomic<unsigned> claimed{0};
+      Producer *peeked = nullptr;
+};
+
+#endif
@@ -0,0 +1,147 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MIX_HPP__
+#define MIX_HPP__
+
+#include <algorithm>
+
+// Where a voice renders to. Voices stage a mono or stereo block and hand it to
+// mix(), which dispatches to kernels specialized at compile time for the channel
+// count, for unit gains, and for overwriting instead of accumulating.
+struct MixTarget
+{
+   enum class Mode { Accumulate, Overwrite };
+
+   inline MixTarget(float **out, const float *amp, unsigned channels, Mode mode = Mode::Accumulate)
+      : out(out), amp(amp), channels(channels), mode(mode)
+   {
+      unit_gain = std::all_of(amp, amp + channels, [](float a) { return a == 1.0f; });
+   }
+
+   float **out;
+   const float *amp;
+   unsigned channels;
+
+   // The first writer of a block overwrites, so output does not have to be cleared up front.
+   // Frames it does not render must be passed to clear().
+   Mode mode;
+   bool unit_gain;
+
+   // Mixes frames from src, which has src_channels (1 or 2) channels, to out at offset.
+   // Output channel c takes source channel c % src_channels.
+   inline void mix(unsigned offset, const float * const *src, unsigned src_channels, unsigned frames) const;
+
+   // Zeroes frames at offset if overwriting, as nothing else will write them.
+   inline void clear(unsigned offset, unsigned frames) const
+   {
+      if (mode == Mode::Overwrite && frames)
+         for (unsigned c = 0; c < channels; c++)
+            std::fill(out[c] + offset, out[c] + offset + frames, 0.0f);
+   }
+};
+
+namespace Mix
+{
+   template<unsigned Channels, unsigned SrcChannels, bool Unit, bool Overwrite>
+   inline void kernel(float * const *out, const float *amp,
+         const float * const *src, unsigned offset, unsigned frames)
+   {
+      for (unsigned c = 0; c < Channels; c++)
+      {
+         float *dst = out[c] + offset;
+         const float *in = src[c % SrcChannels];
+         const float gain = Unit ? 1.0f : amp[c];
+         for (unsigned i = 0; i < frames; i++)
+         {
+            float v = Unit ? in[i] : gain * in[i];
+            if (Overwrite)
+               dst[i] = v;
+            else
+               dst[i] += v;
+         }
+      }
+   }
+
+   // Any number of channels.
+   template<unsigned SrcChannels, bool Overwrite>
+   inline void generic(const MixTarget &target,
+         const float * const *src, unsigned offset, unsigned frames)
+   {
+      for (unsigned c = 0; c < target.channels; c++)
+      {
+         float *dst = target.out[c] + offset;
+         const float *in = src[c % SrcChannels];
+         const float gain = target.amp[c];
+         for (unsigned i = 0; i < frames; i++)
+         {
+            if (Overwrite)
+               dst[i] = gain * in[i];
+            else
+               dst[i] += gain * in[i];
+         }
+      }
+   }
+
+   template<unsigned Channels, unsigned SrcChannels, bool Overwrite>
+   inline void gain_dispatch(const MixTarget &target,
+         const float * const *src, unsigned offset, unsigned frames)
+   {
+      if (target.unit_gain)
+         kernel<Channels, SrcChannels, true, Overwrite>(target.out, target.amp, src, offset, frames);
+      else
+         kernel<Channels, SrcChannels, false, Overwrite>(target.out, target.amp, src, offset, frames);
+   }
+
+   template<unsigned SrcChannels, bool Overwrite>
+   inline void channel_dispatch(const MixTarget &target,
+         const float * const *src, unsigned offset, unsigned frames)
+   {
+      switch (target.channels)
+      {
+         case 1:
+            gain_dispatch<1, SrcChannels, Overwrite>(target, src, offset, frames);
+            break;
+         case 2:
+            gain_dispatch<2, SrcChannels, Overwrite>(target, src, offset, frames);
+            break;
+         default:
+            generic<SrcChannels, Overwrite>(target, src, offset, frames);
+            break;
+      }
+   }
+}
+
+inline void MixTarget::mix(unsigned offset, const float * const *src, unsigned src_channels, unsigned frames) const
+{
+   bool overwrite = mode == Mode::Overwrite;
+   if (src_channels == 1)
+   {
+      if (overwrite)
+         Mix::channel_dispatch<1, true>(*this, src, offset, frames);
+      else
+         Mix::channel_dispatch<1, false>(*this, src, offset, frames);
+   }
+   else
+   {
+      if (overwrite)
+         Mix::channel_dispatch<2, true>(*this, src, offset, frames);
+      else
+         Mix::channel_dispatch<2, false>(*this, src, offset, frames);
+   }
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "modulation.hpp"
+#include <cmath>
+
+using namespace std;
+
+namespace
+{
+   enum { table_size = 256 };
+
+   struct Tables
+   {
+      Tables()
+      {
+         for (unsigned i = 0; i <= table_size; i++)
+         {
+            exp2[i] = pow(2.0, double(i) / table_size);
+            sine[i] = sin(2.0 * M_PI * i / table_size);
+         }
+      }
+
+      float exp2[table_size + 1];
+      float sine[table_size + 1];
+   };
+
+   const Tables tables;
+
+   inline float lookup(const float *table, float pos)
+   {
+      unsigned index = unsigned(pos);
+      float frac = pos - index;
+      return table[index] + frac * (table[index + 1] - table[index]);
+   }
+}
+
+float Pitch::ratio(float semitones)
+{
+   float octaves = semitones * (1.0f / 12.0f);
+   float whole = floor(octaves);
+   return ldexp(lookup(tables.exp2, (octaves - whole) * table_size), int(whole));
+}
+
+float Pitch::sine(float phase)
+{
+   return lookup(tables.sine, phase * table_size);
+}
+
+void Modulator::set_pitch_bend(unsigned value)
+{
+   bend = (int(value) - 0x2000) * (1.0f / 0x2000);
+}
+
+void Modulator::set_pressure(unsigned value)
+{
+   pressure = value * (1.0f / 127.0f);
+}
+
+bool Modulator::set_control(unsigned controller, unsigned value)
+{
+   switch (controller)
+   {
+      case 1: // Modulation wheel
+         mod_wheel = value * (1.0f / 127.0f);
+         return true;
+
+      case 6: // Data entry, semitones
+         if (rpn_msb == 0 && rpn_lsb == 0)
+            bend_range = value + (bend_range - floor(bend_range));
+         return true;
+
+      case 38: // Data entry, cents
+         if (rpn_msb == 0 && rpn_lsb == 0)
+            bend_range = floor(bend_range) + value * 0.01f;
+         return true;
+
+      case 76: // Vibrato rate, 64 is the default and 32 steps are an octave.
+         vibrato_rate = 5.5f * Pitch::ratio((int(value) - 64) * (12.0f / 32.0f));
+         return true;
+
+      case 77: // Vibrato depth, 64 is the default.
+         vibrato_depth = 0.5f * value * (1.0f / 64.0f);
+         return true;
+
+      case 100:
+         rpn_lsb = value;
+         return true;
+
+      case 101:
+         rpn_msb = value;
+         return true;
+
+      case 121: // Reset all controllers
+         bend = 0.0f;
+         mod_wheel = 0.0f;
+         pressure = 0.0f;
+         rpn_msb = rpn_lsb = 127;
+         return true;
+
+      default:
+         return false;
+   }
+}
+
+void Modulator::reset()
+{
+   *this = Modulator();
+}
+
+float Modulator::advance(unsigned frames, unsigned sample_rate)
+{
+   float semitones = bend * bend_range;
+
+   float amount = vibrato_amount();
+   if (amount > 0.0f)
+   {
+      lfo_phase += vibrato_rate * frames / sample_rate;
+      lfo_phase -= floor(lfo_phase);
+      semitones += amount * vibrato_depth * Pitch::sine(lfo_phase);
+   }
+   else
+      lfo_phase = 0.0f;
+
+   current = semitones != 0.0f ? Pitch::ratio(semitones) : 1.0f;
+   return current;
+}
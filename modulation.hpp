@@ -0,0 +1,158 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MODULATION_HPP__
+#define MODULATION_HPP__
+
+#include <cstdint>
+
+namespace Pitch
+{
+   // Frequency ratio of an offset in semitones. Table driven, so control rate
+   // code never has to call pow().
+   float ratio(float semitones);
+
+   // Sine of a phase in cycles, [0, 1).
+   float sine(float phase);
+}
+
+// Pitch ratios at the end of each control period of the frames ahead, relative to
+// the frequency of the note. Voices glide through them linearly, starting from
+// the ratio they are at. Without points, voices jump to ratio right away.
+// Points must stay valid until the voices have rendered frames.
+struct PitchCurve
+{
+   float ratio = 1.0f;
+   const float *points = nullptr;
+   unsigned count = 0;
+   unsigned period = 0; // Frames between points.
+   unsigned frames = 0; // Covered by the points, so the last period may be shorter.
+};
+
+// Position of a voice on a PitchCurve, which voices advance as they render.
+struct PitchRamp
+{
+   float ratio = 1.0f; // Where the curve starts, or the ratio once it has ended.
+   PitchCurve curve;
+   unsigned pos = 0;
+
+   inline void set(const PitchCurve &curve)
+   {
+      ratio = curve.count ? at(0) : curve.ratio;
+      this->curve = curve;
+      pos = 0;
+   }
+
+   inline float at(unsigned offset) const
+   {
+      if (!curve.count)
+         return ratio;
+
+      unsigned frame = pos + offset;
+      if (frame >= curve.frames)
+         return curve.points[curve.count - 1];
+
+      unsigned index = frame / curve.period;
+      unsigned begin = index * curve.period;
+      unsigned len = curve.frames - begin < curve.period ? curve.frames - begin : curve.period;
+      float from = index ? curve.points[index - 1] : ratio;
+      return from + (curve.points[index] - from) * float(frame - begin) / float(len);
+   }
+
+   // Frames until the next point, and the ratio there. 0 once the curve has ended.
+   inline unsigned segment(float &target) const
+   {
+      if (!curve.count || pos >= curve.frames)
+         return 0;
+
+      unsigned index = pos / curve.period;
+      unsigned end = (index + 1) * curve.period;
+      target = curve.points[index];
+      return (end < curve.frames ? end : curve.frames) - pos;
+   }
+
+   inline void advance(unsigned offset)
+   {
+      if (!curve.count)
+         return;
+
+      pos += offset;
+      if (pos >= curve.frames)
+      {
+         ratio = curve.points[curve.count - 1];
+         curve.count = 0;
+      }
+   }
+
+   inline bool unity() const
+   {
+      return !curve.count && ratio == 1.0f;
+   }
+};
+
+// Pitch modulation of a MIDI channel. Controllers update it as they arrive,
+// pitch is evaluated once every control_frames by advance().
+class Modulator
+{
+   public:
+      enum { control_frames = 64 };
+
+      // 14-bit value, centered on 0x2000.
+      void set_pitch_bend(unsigned value);
+      // Channel pressure deepens vibrato like the modulation wheel does.
+      void set_pressure(unsigned value);
+      // Handles the modulation wheel, vibrato rate and depth, pitch bend range (RPN 0)
+      // and reset all controllers. Returns false for any other controller.
+      bool set_control(unsigned controller, unsigned value);
+
+      void reset();
+
+      // True while the pitch is, or can become, anything but the note's own.
+      inline bool active() const
+      {
+         return bend != 0.0f || vibrato_amount() > 0.0f || current != 1.0f;
+      }
+
+      // Moves frames forward in time and returns the pitch ratio there.
+      float advance(unsigned frames, unsigned sample_rate);
+
+      // Pitch ratio as of the last call to advance().
+      inline float ratio() const { return current; }
+
+   private:
+      float bend = 0.0f;
+      float bend_range = 2.0f;
+      float mod_wheel = 0.0f;
+      float pressure = 0.0f;
+
+      // Vibrato at full modulation, in Hz and semitones.
+      float vibrato_rate = 5.5f;
+      float vibrato_depth = 0.5f;
+      float lfo_phase = 0.0f;
+
+      uint8_t rpn_msb = 127;
+      uint8_t rpn_lsb = 127;
+
+      float current = 1.0f;
+
+      inline float vibrato_amount() const
+      {
+         float amount = mod_wheel + pressure;
+         return amount < 1.0f ? amount : 1.0f;
+      }
+};
+
+#endif
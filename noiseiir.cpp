@@ -1,24 +1,92 @@
 #include "synth.hpp"
 #include "flute_iir.h"
 #include <algorithm>
+#include <stdexcept>
 
 using namespace std;
 
 PolyphaseBank NoiseIIR::static_bank;
+PolyphaseBank NoiseIIR::static_reduced_bank{8, 1 << 8};
+DenormalCounter NoiseIIR::denormals{"NoiseIIR"};
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 void NoiseIIR::trigger(unsigned note, unsigned vel, unsigned sample_rate, float detune)
 {
    Voice::trigger(note, vel, sample_rate);
 
-   fill(begin(history_l), end(history_l), 0.0f);
-   fill(begin(history_r), end(history_r), 0.0f);
+   fill(history_l, history_l + 2 * history_len, 0.0f);
+   fill(history_r, history_r + 2 * history_len, 0.0f);
    history_ptr = 0;
+   rendered_quality = Quality::Full;
+   crossfade = 0;
 
    float offset = note - (69.0f + 7.0f);
    decimate_factor = unsigned(round(((1.0f + detune) * 44100.0f / sample_rate) *
             interpolate_factor * pow(2.0f, offset / 12.0f)));
    phase = 0;
+   phase_frac = 0;
+   phase_step = step_target = decimate_factor << step_bits;
+   step_ramp = 0;
+   pitch = PitchRamp();
+}
+
+void NoiseIIR::set_pitch(const PitchCurve &curve)
+{
+   pitch.set(curve);
+   if (curve.count)
+      next_pitch_segment();
+   else
+   {
+      phase_step = step_target = uint32_t(decimate_factor * double(curve.ratio) * (1 << step_bits) + 0.5);
+      step_ramp = 0;
+   }
+}
+
+void NoiseIIR::skip_pitch(unsigned frames)
+{
+   while (frames && step_ramp)
+   {
+      unsigned skip = min(frames, step_ramp);
+      phase_step += step_delta * int32_t(skip);
+      step_ramp -= skip;
+      frames -= skip;
+      if (!step_ramp)
+      {
+         phase_step = step_target;
+         next_pitch_segment();
+      }
+   }
+}
+
+// Ramps the phase step to the next point of the curve, if there is one.
+void NoiseIIR::next_pitch_segment()
+{
+   float ratio;
+   unsigned frames = pitch.segment(ratio);
+   if (!frames)
+      return;
+
+   pitch.advance(frames);
+   step_target = uint32_t(decimate_factor * double(ratio) * (1 << step_bits) + 0.5);
+   step_ramp = frames;
+   step_delta = (int32_t(step_target) - int32_t(phase_step)) / int32_t(frames);
+}
+
+inline void NoiseIIR::advance_phase()
+{
+   if (step_ramp)
+   {
+      phase_step += step_delta;
+      if (!--step_ramp)
+      {
+         phase_step = step_target;
+         next_pitch_segment();
+      }
+   }
+
+   phase_frac += phase_step;
+   phase += phase_frac >> step_bits;
+   phase_frac &= (1u << step_bits) - 1;
 }
 
 NoiseIIR::NoiseIIR(const PolyphaseBank *bank)
@@ -29,59 +97,134 @@ NoiseIIR::NoiseIIR(const PolyphaseBank *bank)
    this->bank = bank;
    interpolate_factor = bank->phases;
    history_len = bank->taps;
+   if (history_len > max_taps)
+      throw runtime_error("PolyphaseBank has too many taps for NoiseIIR.");
+
+   fill(history_l, history_l + 2 * history_len, 0.0f);
+   fill(history_r, history_r + 2 * history_len, 0.0f);
+
+   // The reduced filter can only be used if its phases line up with ours.
+   const PolyphaseBank *reduced = &static_reduced_bank;
+   unsigned shift = 0;
+   while ((reduced->phases << shift) < interpolate_factor)
+      shift++;
+
+   if ((reduced->phases << shift) == interpolate_factor &&
+         reduced->taps <= history_len && ((history_len - reduced->taps) & 1) == 0)
+   {
+      reduced_bank = reduced;
+      reduced_shift = shift;
+      reduced_offset = (history_len - reduced->taps) / 2;
+   }
+}
+
+inline void NoiseIIR::interpolate(Quality tier, float *res) const
+{
+   const float *src_l = history_l + history_ptr;
+   const float *src_r = history_r + history_ptr;
+   const float *filter;
+   unsigned taps;
+
+   if (tier == Quality::Reduced)
+   {
+      filter = reduced_bank->buffer.data() + (phase >> reduced_shift) * reduced_bank->taps;
+      taps = reduced_bank->taps;
+      src_l += reduced_offset;
+      src_r += reduced_offset;
+   }
+   else
+   {
+      filter = bank->buffer.data() + phase * bank->taps;
+      taps = history_len;
+   }
 
-   history_l.clear();
-   history_l.resize(2 * history_len);
-   history_r.clear();
-   history_r.resize(2 * history_len);
+   float l = 0.0f, r = 0.0f;
+   for (unsigned i = 0; i < taps; i++)
+   {
+      l += filter[i] * src_l[i];
+      r += filter[i] * src_r[i];
+   }
+   res[0] = l;
+   res[1] = r;
 }
 
 NoiseIIR::NoiseIIR()
    : NoiseIIR(&static_bank)
 {}
 
-unsigned NoiseIIR::render(float **out, const float *amp, unsigned frames, unsigned channels)
+unsigned NoiseIIR::render(const MixTarget &target, unsigned frames)
 {
-   unsigned s;
-   for (s = 0; s < frames; s++, phase += decimate_factor)
+   Quality tier = reduced_bank ? quality() : Quality::Full;
+   if (tier != rendered_quality)
    {
-      if (check_release_complete())
-         break;
+      // Reversing a crossfade which is still running continues from where it is.
+      rendered_quality = tier;
+      crossfade = crossfade_len - crossfade;
+   }
+   Quality previous = tier == Quality::Full ? Quality::Reduced : Quality::Full;
+
+   float stage_l[256], stage_r[256];
+   const float *stage[2] = { stage_l, stage_r };
 
-      while (phase >= interpolate_factor)
+   unsigned s = 0;
+   bool done = false;
+   while (s < frames && !done)
+   {
+      unsigned process_frames = min(256u, frames - s);
+      unsigned i;
+      for (i = 0; i < process_frames; i++, advance_phase())
       {
-         history_ptr = (history_ptr ? history_ptr : history_len) - 1;
-         history_l[history_ptr] = history_l[history_ptr + history_len] = noise_step(iir_l); 
-         history_r[history_ptr] = history_r[history_ptr + history_len] = noise_step(iir_r); 
-         phase -= interpolate_factor;
-      }
+         if (check_release_complete())
+         {
+            done = true;
+            break;
+         }
 
-      const float *filter = bank->buffer.data() + phase * bank->taps;
+         while (phase >= interpolate_factor)
+         {
+            history_ptr = (history_ptr ? history_ptr : history_len) - 1;
+            history_l[history_ptr] = history_l[history_ptr + history_len] = noise_step(iir_l); 
+            history_r[history_ptr] = history_r[history_ptr + history_len] = noise_step(iir_r); 
+            phase -= interpolate_factor;
+         }
 
-      const float *src_l = history_l.data() + history_ptr;
-      const float *src_r = history_r.data() + history_ptr;
+         float res[2];
+         interpolate(tier, res);
 
-      float res[2] = {0.0, 0.0};
-      for (unsigned i = 0; i < history_len; i++)
-      {
-         res[0] += filter[i] * src_l[i];
-         res[1] += filter[i] * src_r[i];
-      }
+         if (crossfade)
+         {
+            float prev[2];
+            interpolate(previous, prev);
+            float mix = crossfade * (1.0f / crossfade_len);
+            res[0] += mix * (prev[0] - res[0]);
+            res[1] += mix * (prev[1] - res[1]);
+            crossfade--;
+         }
 
-      float env_mod = envelope_amp();
-      for (unsigned c = 0; c < channels; c++)
-         out[c][s] += amp[c] * env_mod * res[c & 1];
+         float env_mod = envelope_amp();
+         stage_l[i] = env_mod * res[0];
+         stage_r[i] = env_mod * res[1];
+
+         step();
+      }
 
-      step();
+      target.mix(s, stage, 2, i);
+      s += i;
    }
 
+   // Filter state persists across blocks, make sure it never goes subnormal.
+   iir_l.flush_denormals();
+   iir_r.flush_denormals();
+   flush_denormals(history_l, 2 * history_len, denormals);
+   flush_denormals(history_r, 2 * history_len, denormals);
+
    return s;
 }
 
 float NoiseIIR::IIR::step(float v)
 {
    float res = 0.0;
-   const float *src = buffer.data() + ptr;
+   const float *src = buffer + ptr;
    for (unsigned i = 0; i < len; i++)
       res += src[i] * filter[i];
    res += v;
@@ -91,15 +234,49 @@ float NoiseIIR::IIR::step(float v)
    return res;
 }
 
+uint64_t NoiseIIR::parameter_hash() const
+{
+   const unsigned geometry[] = { bank->taps, bank->phases, max_taps, crossfade_len, step_bits,
+      iir_l.len, iir_r.len };
+   const float range[] = { dist.a(), dist.b() };
+   uint64_t hash = hash_bytes(geometry, sizeof(geometry));
+   hash = hash_bytes(range, sizeof(range), hash);
+   hash = hash_bytes(bank->buffer.data(), bank->buffer.size() * sizeof(float), hash);
+   if (reduced_bank)
+      hash = hash_bytes(reduced_bank->buffer.data(), reduced_bank->buffer.size() * sizeof(float), hash);
+   hash = hash_bytes(iir_l.filter, iir_l.len * sizeof(float), hash);
+   return hash_bytes(iir_r.filter, iir_r.len * sizeof(float), hash);
+}
+
 void NoiseIIR::IIR::set_filter(const float *filter, unsigned len)
 {
+   if (len > max_iir_len)
+      throw runtime_error("IIR filter is too long for NoiseIIR.");
+
    this->filter = filter;
    this->len = len;
-   buffer.clear();
-   buffer.resize(2 * len);
+   fill(buffer, buffer + 2 * len, 0.0f);
    ptr = 0;
 }
 
+void NoiseIIR::IIR::reset()
+{
+   fill(buffer, buffer + 2 * len, 0.0f);
+   ptr = 0;
+}
+
+void NoiseIIR::seed(uint32_t seed)
+{
+   engine.seed(seed);
+   iir_l.reset();
+   iir_r.reset();
+}
+
+void NoiseIIR::IIR::flush_denormals()
+{
+   ::flush_denormals(buffer, 2 * len, NoiseIIR::denormals);
+}
+
 float NoiseIIR::noise_step(IIR &iir)
 {
    return iir.step(dist(engine));
@@ -0,0 +1,295 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "note_cache.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+
+using namespace std;
+
+static const char file_magic[8] = { 'A', 'I', 'R', 'N', 'O', 'T', 'E', '1' };
+
+NoteCache::NoteCache(size_t memory_limit, const string &dir, size_t disk_limit)
+   : memory_limit(memory_limit), dir(dir), disk_limit(disk_limit)
+{
+   if (!dir.empty())
+   {
+      mkdir(dir.c_str(), 0755);
+      scan_disk();
+   }
+}
+
+NoteCache::Key NoteCache::make_key()
+{
+   Key key;
+   memset(&key, 0, sizeof(key));
+   key.version = version;
+   return key;
+}
+
+// FNV-1a over the raw bytes.
+uint64_t NoteCache::Key::hash() const
+{
+   auto bytes = reinterpret_cast<const uint8_t*>(this);
+   uint64_t hash = 0xcbf29ce484222325ull;
+   for (size_t i = 0; i < sizeof(Key); i++)
+   {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ull;
+   }
+   return hash;
+}
+
+bool NoteCache::Key::operator==(const Key &key) const
+{
+   return !memcmp(this, &key, sizeof(Key));
+}
+
+string NoteCache::path(uint64_t hash) const
+{
+   char name[32];
+   snprintf(name, sizeof(name), "/%016llx.note", (unsigned long long)hash);
+   return dir + name;
+}
+
+// Files are ordered by modification time, which hits refresh.
+void NoteCache::scan_disk()
+{
+   DIR *handle = opendir(dir.c_str());
+   if (!handle)
+   {
+      fprintf(stderr, "Cannot open note cache %s, caching in memory only.\n", dir.c_str());
+      dir.clear();
+      return;
+   }
+
+   vector<pair<time_t, pair<uint64_t, size_t>>> files;
+   while (struct dirent *entry = readdir(handle))
+   {
+      const char *name = entry->d_name;
+      if (strlen(name) != 21 || strcmp(name + 16, ".note"))
+         continue;
+
+      char *end = nullptr;
+      uint64_t hash = strtoull(name, &end, 16);
+      struct stat st;
+      if (end != name + 16 || stat(path(hash).c_str(), &st) < 0)
+         continue;
+      files.push_back({st.st_mtime, {hash, size_t(st.st_size)}});
+   }
+   closedir(handle);
+
+   sort(begin(files), end(files));
+   for (auto &file : files)
+   {
+      disk_lru.push_front(file.second.first);
+      disk[file.second.first] = { file.second.second, begin(disk_lru) };
+      stats.disk_bytes += file.second.second;
+   }
+   evict_disk(0);
+}
+
+void NoteCache::evict_disk(size_t bytes)
+{
+   while (!disk_lru.empty() && stats.disk_bytes + bytes > disk_limit)
+   {
+      uint64_t hash = disk_lru.back();
+      disk_lru.pop_back();
+      auto itr = disk.find(hash);
+      stats.disk_bytes -= itr->second.bytes;
+      disk.erase(itr);
+      unlink(path(hash).c_str());
+   }
+}
+
+NoteCache::Audio NoteCache::load(uint64_t hash, const Key &key) const
+{
+   string file_path = path(hash);
+   FILE *file = fopen(file_path.c_str(), "rb");
+   if (!file)
+      return {};
+
+   // The size is checked against the file itself, the index may have changed since.
+   struct stat st;
+   char magic[sizeof(file_magic)];
+   Key file_key;
+   uint64_t samples = 0;
+   Audio audio;
+   if (fstat(fileno(file), &st) == 0 &&
+         fread(magic, sizeof(magic), 1, file) == 1 && !memcmp(magic, file_magic, sizeof(magic)) &&
+         fread(&file_key, sizeof(file_key), 1, file) == 1 && file_key == key &&
+         fread(&samples, sizeof(samples), 1, file) == 1 &&
+         samples * sizeof(float) + sizeof(magic) + sizeof(Key) + sizeof(samples) == uint64_t(st.st_size))
+   {
+      shared_ptr<vector<float>> data(new vector<float>(samples));
+      if (fread(data->data(), sizeof(float), samples, file) == samples)
+         audio = data;
+   }
+   fclose(file);
+
+   if (audio)
+      utime(file_path.c_str(), nullptr);
+   return audio;
+}
+
+// Written to a temporary file, which is renamed into place by publish(),
+// so readers never see partial notes.
+size_t NoteCache::store(uint64_t hash, const Key &key, const vector<float> &audio,
+      string &tmp_path) const
+{
+   size_t bytes = sizeof(file_magic) + sizeof(Key) + sizeof(uint64_t) + audio.size() * sizeof(float);
+   if (bytes > disk_limit)
+      return 0;
+
+   tmp_path = path(hash) + ".XXXXXX";
+   int fd = mkstemp(&tmp_path[0]);
+   if (fd < 0)
+      return 0;
+
+   FILE *file = fdopen(fd, "wb");
+   uint64_t samples = audio.size();
+   bool ok = file &&
+      fwrite(file_magic, sizeof(file_magic), 1, file) == 1 &&
+      fwrite(&key, sizeof(key), 1, file) == 1 &&
+      fwrite(&samples, sizeof(samples), 1, file) == 1 &&
+      fwrite(audio.data(), sizeof(float), samples, file) == samples;
+
+   if (file)
+      ok = fclose(file) == 0 && ok;
+   else
+      close(fd);
+
+   if (!ok)
+   {
+      unlink(tmp_path.c_str());
+      return 0;
+   }
+   return bytes;
+}
+
+void NoteCache::publish(uint64_t hash, const string &tmp_path, size_t bytes)
+{
+   if (rename(tmp_path.c_str(), path(hash).c_str()) < 0)
+   {
+      unlink(tmp_path.c_str());
+      return;
+   }
+
+   auto itr = disk.find(hash);
+   if (itr != end(disk))
+   {
+      stats.disk_bytes -= itr->second.bytes;
+      disk_lru.erase(itr->second.lru);
+      disk.erase(itr);
+   }
+
+   evict_disk(bytes);
+   disk_lru.push_front(hash);
+   disk[hash] = { bytes, begin(disk_lru) };
+   stats.disk_bytes += bytes;
+}
+
+void NoteCache::insert_memory(uint64_t hash, const Key &key, Audio audio)
+{
+   size_t bytes = audio->size() * sizeof(float);
+   if (bytes > memory_limit)
+      return;
+
+   auto itr = memory.find(hash);
+   if (itr != end(memory))
+   {
+      stats.memory_bytes -= itr->second.audio->size() * sizeof(float);
+      memory_lru.erase(itr->second.lru);
+      memory.erase(itr);
+   }
+
+   while (!memory_lru.empty() && stats.memory_bytes + bytes > memory_limit)
+   {
+      auto victim = memory.find(memory_lru.back());
+      stats.memory_bytes -= victim->second.audio->size() * sizeof(float);
+      memory.erase(victim);
+      memory_lru.pop_back();
+   }
+
+   memory_lru.push_front(hash);
+   memory[hash] = { key, move(audio), begin(memory_lru) };
+   stats.memory_bytes += bytes;
+}
+
+NoteCache::Audio NoteCache::find(const Key &key)
+{
+   uint64_t hash = key.hash();
+   unique_lock<mutex> holder{lock};
+
+   auto itr = memory.find(hash);
+   if (itr != end(memory) && itr->second.key == key)
+   {
+      memory_lru.splice(begin(memory_lru), memory_lru, itr->second.lru);
+      stats.hits++;
+      return itr->second.audio;
+   }
+
+   if (dir.empty() || !disk.count(hash))
+   {
+      stats.misses++;
+      return {};
+   }
+
+   holder.unlock();
+   auto audio = load(hash, key);
+   holder.lock();
+
+   if (!audio)
+   {
+      stats.misses++;
+      return {};
+   }
+
+   // The note may have been evicted or replaced while it was read.
+   auto disk_itr = disk.find(hash);
+   if (disk_itr != end(disk))
+      disk_lru.splice(begin(disk_lru), disk_lru, disk_itr->second.lru);
+   insert_memory(hash, key, audio);
+   stats.hits++;
+   stats.disk_hits++;
+   return audio;
+}
+
+void NoteCache::insert(const Key &key, Audio audio)
+{
+   uint64_t hash = key.hash();
+   string tmp_path;
+   size_t bytes = dir.empty() ? 0 : store(hash, key, *audio, tmp_path);
+
+   lock_guard<mutex> holder{lock};
+   if (bytes)
+      publish(hash, tmp_path, bytes);
+   insert_memory(hash, key, move(audio));
+}
+
+NoteCache::Stats NoteCache::get_stats() const
+{
+   lock_guard<mutex> holder{lock};
+   return stats;
+}
@@ -0,0 +1,122 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NOTE_CACHE_HPP__
+#define NOTE_CACHE_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+// Rendered notes, addressed by a hash of everything their audio depends on.
+// Recently used notes are kept in memory. With a directory, notes are also
+// stored on disk and shared between runs. Both tiers are bounded in size and
+// evict the least recently used notes first. Thread safe.
+class NoteCache
+{
+   public:
+      NoteCache(size_t memory_limit, const std::string &dir = "", size_t disk_limit = 0);
+
+      NoteCache(NoteCache&&) = delete;
+      void operator=(NoteCache&&) = delete;
+
+      // Must be zero-initialized before it is filled in, it is hashed and compared bytewise.
+      struct Key
+      {
+         uint64_t voice_type;
+         uint64_t parameters; // Voice::parameter_hash() of the program.
+         uint64_t release; // Frames from the start of the note, ~0 if never.
+         uint64_t length;  // Frames after which the note is cut.
+         uint32_t version;
+         uint32_t program;
+         uint32_t sample_rate;
+         uint32_t note;
+         uint32_t velocity;
+         uint32_t seed;
+         float detune;
+         float gain, attack, delay, sustain_level, release_time, silence;
+         uint32_t reserved;
+
+         uint64_t hash() const;
+         bool operator==(const Key &key) const;
+      };
+
+      static Key make_key();
+
+      // Planar stereo, length frames per channel.
+      typedef std::shared_ptr<const std::vector<float>> Audio;
+
+      // Null on a miss.
+      Audio find(const Key &key);
+      void insert(const Key &key, Audio audio);
+
+      struct Stats
+      {
+         unsigned hits = 0;
+         unsigned disk_hits = 0;
+         unsigned misses = 0;
+         size_t memory_bytes = 0;
+         size_t disk_bytes = 0;
+      };
+      Stats get_stats() const;
+
+      // Bump when voices change in a way which changes their output.
+      enum { version = 2 };
+
+   private:
+      mutable std::mutex lock;
+      Stats stats;
+
+      struct Entry
+      {
+         Key key;
+         Audio audio;
+         std::list<uint64_t>::iterator lru;
+      };
+      std::unordered_map<uint64_t, Entry> memory;
+      std::list<uint64_t> memory_lru;
+      size_t memory_limit;
+
+      struct DiskEntry
+      {
+         size_t bytes;
+         std::list<uint64_t>::iterator lru;
+      };
+      std::unordered_map<uint64_t, DiskEntry> disk;
+      std::list<uint64_t> disk_lru;
+      std::string dir;
+      size_t disk_limit;
+
+      // Files are read and written without holding lock. Finished files are renamed
+      // into place, and evicted ones removed, with lock held, so the files under
+      // their final names always match the index.
+      std::string path(uint64_t hash) const;
+      void scan_disk();
+      Audio load(uint64_t hash, const Key &key) const;
+      // Returns the bytes written to tmp_path, 0 if the note was not stored.
+      size_t store(uint64_t hash, const Key &key, const std::vector<float> &audio,
+            std::string &tmp_path) const;
+      void publish(uint64_t hash, const std::string &tmp_path, size_t bytes);
+      void insert_memory(uint64_t hash, const Key &key, Audio audio);
+      void evict_disk(size_t bytes);
+};
+
+#endif
@@ -0,0 +1,307 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "note_render.hpp"
+#include "midi_file.hpp"
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+constexpr uint64_t NoteRenderer::never;
+
+NoteRenderer::NoteRenderer(shared_ptr<AirSynth> synth, const string &midi_path,
+      const string &output_path, unsigned sample_rate, unsigned threads,
+      shared_ptr<NoteCache> cache)
+   : synth(move(synth)), midi_path(midi_path), sink(output_path, channels, sample_rate),
+     sample_rate(sample_rate), cache(move(cache))
+{
+   if (!threads)
+      threads = max(thread::hardware_concurrency(), 1u);
+   workers.reset(new WorkerPool(threads - 1, -1));
+}
+
+void NoteRenderer::stop()
+{
+   stopped = true;
+}
+
+// Follows the same rules as Synthesizer and Instrument: a note-off releases every
+// voice of that note, unless the pedal holds it until the pedal comes up.
+void NoteRenderer::scan()
+{
+   MidiFile midi(midi_path);
+
+   unsigned programs[Synthesizer::num_midi_channels];
+   bool pedal[Synthesizer::num_midi_channels] = {};
+   vector<unsigned> held[Synthesizer::num_midi_channels][128];
+   vector<unsigned> sustained[Synthesizer::num_midi_channels];
+   for (unsigned c = 0; c < Synthesizer::num_midi_channels; c++)
+      programs[c] = synth->get_program(c);
+
+   auto release = [this](unsigned index, uint64_t frame) {
+      jobs[index].release = min(jobs[index].release, frame);
+   };
+
+   uint64_t last_frame = 0;
+   MidiFile::Event event;
+   while (midi.next(event))
+   {
+      uint64_t frame = uint64_t(llround(event.time * sample_rate));
+      last_frame = frame;
+
+      uint8_t status = event.data[0];
+      unsigned channel = status & 0xf;
+      unsigned lo = event.data[1];
+      unsigned hi = event.data[2];
+
+      switch (status >> 4)
+      {
+         case 0x9:
+            if (hi)
+            {
+               if (synth->has_program(programs[channel]))
+               {
+                  held[channel][lo].push_back(jobs.size());
+                  jobs.push_back({programs[channel], lo, hi, frame, never, never, 0.0f, {}, 0});
+               }
+               break;
+            }
+            // Velocity 0 is a note-off.
+            // Fall through.
+
+         case 0x8:
+            for (auto index : held[channel][lo])
+            {
+               if (pedal[channel])
+                  sustained[channel].push_back(index);
+               else
+                  release(index, frame);
+            }
+            held[channel][lo].clear();
+            break;
+
+         case 0xb:
+            if (lo == 64 && bool(hi) != pedal[channel])
+            {
+               pedal[channel] = hi;
+               if (!hi)
+               {
+                  for (auto index : sustained[channel])
+                     release(index, frame);
+                  sustained[channel].clear();
+               }
+            }
+            break;
+
+         case 0xc:
+            if (synth->has_program(lo))
+               programs[channel] = lo;
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   uint64_t tail_end = last_frame + uint64_t(max_tail * sample_rate);
+   prototypes.resize(AirSynth::num_programs);
+   for (auto &job : jobs)
+   {
+      job.end = tail_end;
+
+      auto &prototype = prototypes[job.program];
+      if (!prototype.voices)
+      {
+         prototype.voices = synth->create_voices(job.program, 1);
+         const char *type = prototype.voices->voice_type();
+         prototype.type_hash = hash_bytes(type, strlen(type));
+         prototype.parameter_hash = (*prototype.voices)[0].parameter_hash();
+      }
+   }
+}
+
+NoteCache::Key NoteRenderer::make_key(const Job &job, uint64_t length) const
+{
+   auto &prototype = prototypes[job.program];
+   auto &env = (*prototype.voices)[0].get_envelope();
+
+   auto key = NoteCache::make_key();
+   key.voice_type = prototype.type_hash;
+   key.parameters = prototype.parameter_hash;
+   key.release = job.release == never ? never : job.release - job.start;
+   key.length = length;
+   key.program = job.program;
+   key.sample_rate = sample_rate;
+   key.note = job.note;
+   key.velocity = job.velocity;
+   key.seed = note_seed;
+   key.detune = job.detune;
+   key.gain = env.gain;
+   key.attack = env.attack;
+   key.delay = env.delay;
+   key.sustain_level = env.sustain_level;
+   key.release_time = env.release;
+   key.silence = env.silence;
+   return key;
+}
+
+void NoteRenderer::render_job(void *data, unsigned index)
+{
+   auto &self = *static_cast<NoteRenderer*>(data);
+   auto &job = self.jobs[self.batch_first + index];
+   if (self.stopped)
+      return;
+
+   uint64_t length = job.end - job.start;
+   if (job.release != never)
+      length = min(length, job.release - job.start + uint64_t(self.max_tail * self.sample_rate));
+
+   NoteCache::Key key = self.make_key(job, length);
+   if (self.cache)
+      job.audio = self.cache->find(key);
+
+   if (!job.audio)
+   {
+      job.audio = self.render_note(job, length);
+      if (self.cache)
+         self.cache->insert(key, job.audio);
+   }
+
+   job.length = unsigned(min(uint64_t(job.audio->size() / channels), job.end - job.start));
+}
+
+NoteCache::Audio NoteRenderer::render_note(const Job &job, uint64_t length) const
+{
+   auto voices = synth->create_voices(job.program, 1);
+   auto &voice = (*voices)[0];
+   voice.seed(note_seed);
+   voices->trigger(0, job.note, job.velocity, sample_rate, job.detune);
+
+   const unsigned first = 0;
+   const float amp[channels] = { 1.0f, 1.0f };
+   vector<float> left, right;
+
+   uint64_t release = job.release == never ? never : job.release - job.start;
+   uint64_t pos = 0;
+   while (pos < length && voice.active())
+   {
+      if (pos == release)
+         voice.release(false);
+
+      uint64_t until = pos < release ? min(release, length) : length;
+      unsigned frames = unsigned(min(until - pos, uint64_t(block_frames)));
+
+      left.resize(pos + frames);
+      right.resize(pos + frames);
+      float *out[channels] = { left.data() + pos, right.data() + pos };
+      voices->render(&first, 1, MixTarget(out, amp, channels, MixTarget::Mode::Overwrite), frames);
+      pos += frames;
+   }
+
+   // Trailing silence of a voice which finished mid-block is dropped.
+   while (pos && left[pos - 1] == 0.0f && right[pos - 1] == 0.0f)
+      pos--;
+
+   shared_ptr<vector<float>> audio(new vector<float>(channels * pos));
+   copy(begin(left), begin(left) + pos, begin(*audio));
+   copy(begin(right), begin(right) + pos, begin(*audio) + pos);
+   return audio;
+}
+
+void NoteRenderer::mix_job(const Job &job)
+{
+   uint64_t offset = job.start - mix_start;
+   size_t needed = size_t((offset + job.length) * channels);
+   if (mix.size() < needed)
+      mix.resize(needed, 0.0f);
+
+   // The length of the note may be cut short of what was rendered.
+   float *dst = mix.data() + offset * channels;
+   const float *left = job.audio->data();
+   const float *right = left + job.audio->size() / channels;
+   for (unsigned i = 0; i < job.length; i++)
+   {
+      dst[2 * i + 0] += left[i];
+      dst[2 * i + 1] += right[i];
+   }
+}
+
+void NoteRenderer::flush(uint64_t frame)
+{
+   if (frame <= mix_start)
+      return;
+
+   // Frames nothing was mixed into are silent.
+   size_t frames = size_t(frame - mix_start);
+   if (mix.size() < frames * channels)
+      mix.resize(frames * channels, 0.0f);
+
+   sink.write(mix.data(), frames);
+
+   mix.erase(begin(mix), begin(mix) + frames * channels);
+   mix_start = frame;
+}
+
+void NoteRenderer::render()
+{
+   auto start = chrono::steady_clock::now();
+   scan();
+
+   // Jobs are in order of their start, so once a batch is mixed everything
+   // before the next batch starts is final. Batching bounds memory use.
+   double note_frames = 0.0;
+   uint64_t end_frame = 0;
+   for (batch_first = 0; batch_first < jobs.size() && !stopped; batch_first += batch_jobs)
+   {
+      unsigned count = min(unsigned(batch_jobs), unsigned(jobs.size()) - batch_first);
+      workers->run(render_job, this, count);
+
+      for (unsigned i = 0; i < count; i++)
+      {
+         auto &job = jobs[batch_first + i];
+         if (!job.audio)
+            continue;
+         mix_job(job);
+         note_frames += job.length;
+         end_frame = max(end_frame, job.start + job.length);
+         job.audio.reset();
+      }
+
+      uint64_t next = batch_first + count < jobs.size() ? jobs[batch_first + count].start : end_frame;
+      flush(next);
+   }
+   flush(end_frame);
+
+   double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+   double length = double(end_frame) / sample_rate;
+   fprintf(stderr, "Rendered %.1f s (%.1f note-seconds, %u notes) on %u threads in %.2f s, %.1fx real time.\n",
+         length, note_frames / sample_rate, unsigned(jobs.size()), workers->threads(),
+         elapsed, length / max(elapsed, 1e-6));
+
+   if (cache)
+   {
+      auto stats = cache->get_stats();
+      unsigned lookups = stats.hits + stats.misses;
+      fprintf(stderr, "Note cache: %u of %u notes hit (%.0f %%, %u from disk), %.1f MiB in memory, %.1f MiB on disk.\n",
+            stats.hits, lookups, lookups ? 100.0 * stats.hits / lookups : 0.0, stats.disk_hits,
+            stats.memory_bytes / (1024.0 * 1024.0), stats.disk_bytes / (1024.0 * 1024.0));
+   }
+}
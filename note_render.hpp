@@ -0,0 +1,115 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef NOTE_RENDER_HPP__
+#define NOTE_RENDER_HPP__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include "synth.hpp"
+#include "worker_pool.hpp"
+#include "note_cache.hpp"
+#include "audio_sink.hpp"
+
+// Renders a MIDI file offline, one job per note. Note-on, note-off and sustain
+// pedal times are all known up front, so every note renders its own voice into a
+// private buffer on any core. Notes are mixed in file order, so the output does
+// not depend on the number of threads.
+//
+// Notes never steal from each other and always render at full quality.
+// Pitch bend and other modulation are not applied.
+//
+// Notes only depend on their program, pitch, velocity and lifetime, so repeated
+// notes are rendered once and then taken from a NoteCache.
+class NoteRenderer
+{
+   public:
+      // threads includes the calling thread, 0 uses every core.
+      // Without a cache, every note is rendered.
+      NoteRenderer(std::shared_ptr<AirSynth> synth, const std::string &midi_path,
+            const std::string &output_path, unsigned sample_rate, unsigned threads,
+            std::shared_ptr<NoteCache> cache = {});
+
+      NoteRenderer(NoteRenderer&&) = delete;
+      void operator=(NoteRenderer&&) = delete;
+
+      void render();
+      void stop();
+
+      // Notes which are never released are cut this many seconds after the last event.
+      float max_tail = 10.0f;
+
+   private:
+      std::shared_ptr<AirSynth> synth;
+      std::string midi_path;
+      SndfileSink sink;
+      unsigned sample_rate;
+      std::atomic<bool> stopped{false};
+      std::unique_ptr<WorkerPool> workers;
+      std::shared_ptr<NoteCache> cache;
+
+      // One voice of every program which is played, describing the notes of that program.
+      struct Prototype
+      {
+         std::unique_ptr<VoicePoolBase> voices;
+         uint64_t type_hash;
+         uint64_t parameter_hash;
+      };
+      std::vector<Prototype> prototypes;
+
+      // Notes are seeded alike, so identical notes render identically.
+      enum { note_seed = 1 };
+
+      enum { channels = 2, block_frames = 1024, batch_jobs = 256 };
+      static constexpr uint64_t never = ~uint64_t(0);
+
+      struct Job
+      {
+         unsigned program;
+         unsigned note;
+         unsigned velocity;
+         uint64_t start;
+         uint64_t release;
+         uint64_t end;
+         // AirSynth does not detune MIDI notes, but the key and render follow the job.
+         float detune;
+
+         // Planar, length frames per channel. Released notes are rendered
+         // at most max_tail past their release, regardless of end, so they
+         // can be shared with the same note elsewhere.
+         NoteCache::Audio audio;
+         unsigned length;
+      };
+      std::vector<Job> jobs;
+      unsigned batch_first = 0;
+
+      void scan();
+      static void render_job(void *data, unsigned index);
+      NoteCache::Key make_key(const Job &job, uint64_t length) const;
+      NoteCache::Audio render_note(const Job &job, uint64_t length) const;
+
+      // Interleaved mix of frames from mix_start onwards, written once no
+      // later note can touch it.
+      std::vector<float> mix;
+      uint64_t mix_start = 0;
+      void mix_job(const Job &job);
+      void flush(uint64_t frame);
+};
+
+#endif
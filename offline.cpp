@@ -0,0 +1,113 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "audio_driver.hpp"
+#include "midi_file.hpp"
+#include "audio_sink.hpp"
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+OfflineDriver::OfflineDriver(shared_ptr<AudioCallback> cb, MidiFile &midi, AudioSink &sink,
+      unsigned channels, unsigned sample_rate)
+   : AudioDriver(move(cb)), midi(midi), sink(sink), channels(channels), sample_rate(sample_rate)
+{
+   buffer.resize(channels * block_frames);
+   interleaved.resize(channels * block_frames);
+   for (unsigned c = 0; c < channels; c++)
+   {
+      buffer_ptrs.push_back(buffer.data() + c * block_frames);
+      amps.push_back(1.0f);
+   }
+
+   audio_cb->configure_audio(sample_rate, channels);
+   audio_cb->configure_buffer_size(block_frames);
+}
+
+void OfflineDriver::stop()
+{
+   stopped = true;
+}
+
+void OfflineDriver::write(unsigned frames, bool silence)
+{
+   if (silence)
+   {
+      sink.write(nullptr, frames);
+      return;
+   }
+
+   for (unsigned c = 0; c < channels; c++)
+      for (unsigned i = 0; i < frames; i++)
+         interleaved[i * channels + c] = buffer_ptrs[c][i];
+   sink.write(interleaved.data(), frames);
+}
+
+OfflineDriver::Result OfflineDriver::render()
+{
+   uint64_t frame = 0;
+   uint64_t rendered = 0;
+   uint64_t tail_end = 0;
+   uint64_t max_tail_frames = uint64_t(max_tail * sample_rate);
+
+   MidiFile::Event event;
+   bool pending = midi.next(event);
+   auto event_frame = [&]() -> uint64_t {
+      return uint64_t(llround(event.time * sample_rate));
+   };
+
+   while (!stopped)
+   {
+      if (!pending && (audio_cb->idle() || frame >= tail_end))
+         break;
+
+      unsigned frames = block_frames;
+      if (pending)
+      {
+         uint64_t next = event_frame();
+         if (next > frame && audio_cb->idle())
+         {
+            // Nothing sounds until the next event, no need to render.
+            frames = unsigned(min(next - frame, uint64_t(block_frames)));
+            write(frames, true);
+            frame += frames;
+            continue;
+         }
+      }
+      else
+         frames = unsigned(min(tail_end - frame, uint64_t(block_frames)));
+
+      while (pending)
+      {
+         uint64_t next = max(event_frame(), frame);
+         if (next >= frame + frames)
+            break;
+         audio_cb->process_midi(event.data, unsigned(next - frame));
+
+         pending = midi.next(event);
+         if (!pending)
+            tail_end = next + max_tail_frames;
+      }
+
+      audio_cb->process_audio(buffer_ptrs.data(), amps.data(), frames);
+      write(frames, false);
+      frame += frames;
+      rendered += frames;
+   }
+
+   return { frame, rendered };
+}
@@ -0,0 +1,201 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "audio_driver.hpp"
+#include "denormal.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+
+PipeDriver::PipeDriver(shared_ptr<AudioCallback> cb, int input_fd, int output_fd,
+      unsigned channels, unsigned sample_rate, Format format, bool paced, unsigned block_frames)
+   : AudioDriver(move(cb)), input_fd(input_fd), output_fd(output_fd), channels(channels),
+     sample_rate(sample_rate), format(format), paced(paced), block_frames(max(block_frames, 1u))
+{
+   buffer.resize(channels * this->block_frames);
+   for (unsigned c = 0; c < channels; c++)
+   {
+      buffer_ptrs.push_back(buffer.data() + c * this->block_frames);
+      amps.push_back(1.0f);
+   }
+
+   size_t sample_size = format == Format::Float ? sizeof(float) : sizeof(int16_t);
+   output.resize(sample_size * channels * this->block_frames);
+   input.resize(event_size * 512);
+
+   audio_cb->configure_audio(sample_rate, channels);
+   audio_cb->configure_buffer_size(this->block_frames);
+}
+
+void PipeDriver::stop()
+{
+   stopped = true;
+}
+
+bool PipeDriver::read_input(bool wait)
+{
+   if (input_done)
+      return false;
+
+   if (!wait)
+   {
+      pollfd fd = { input_fd, POLLIN, 0 };
+      if (poll(&fd, 1, 0) <= 0)
+         return false;
+   }
+
+   // Keeps a partial event at the front.
+   input_end -= input_pos;
+   memmove(input.data(), input.data() + input_pos, input_end);
+   input_pos = 0;
+
+   ssize_t ret;
+   do
+      ret = ::read(input_fd, input.data() + input_end, input.size() - input_end);
+   while (ret < 0 && errno == EINTR && !stopped);
+
+   if (ret <= 0)
+   {
+      input_done = true;
+      return false;
+   }
+
+   input_end += ret;
+   return true;
+}
+
+bool PipeDriver::next_event(uint64_t &time, AudioCallback::MidiRawData &data, bool wait)
+{
+   while (input_end - input_pos < event_size)
+      if (!read_input(wait))
+         return false;
+
+   const uint8_t *event = input.data() + input_pos;
+   input_pos += event_size;
+
+   time += uint32_t(event[0]) | (uint32_t(event[1]) << 8) |
+      (uint32_t(event[2]) << 16) | (uint32_t(event[3]) << 24);
+   data = {{ event[4], event[5], event[6] }};
+   return true;
+}
+
+bool PipeDriver::write(unsigned frames, bool silence)
+{
+   size_t samples = size_t(frames) * channels;
+   size_t size = samples * (format == Format::Float ? sizeof(float) : sizeof(int16_t));
+   if (silence)
+      fill(begin(output), begin(output) + size, 0);
+   else if (format == Format::Float)
+   {
+      float *out = reinterpret_cast<float*>(output.data());
+      for (unsigned c = 0; c < channels; c++)
+         for (unsigned i = 0; i < frames; i++)
+            out[i * channels + c] = buffer_ptrs[c][i];
+   }
+   else
+   {
+      int16_t *out = reinterpret_cast<int16_t*>(output.data());
+      for (unsigned c = 0; c < channels; c++)
+      {
+         for (unsigned i = 0; i < frames; i++)
+         {
+            float sample = max(min(buffer_ptrs[c][i], 1.0f), -1.0f);
+            out[i * channels + c] = int16_t(lrintf(sample * 0x7fff));
+         }
+      }
+   }
+
+   const uint8_t *ptr = output.data();
+   while (size)
+   {
+      ssize_t ret = ::write(output_fd, ptr, size);
+      if (ret < 0 && errno == EINTR && !stopped)
+         continue;
+      if (ret <= 0)
+         return false;
+      ptr += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+uint64_t PipeDriver::render()
+{
+   DenormalGuard denormal_guard;
+
+   uint64_t frame = 0;
+   uint64_t tail_end = 0;
+   uint64_t max_tail_frames = uint64_t(max_tail * sample_rate);
+
+   uint64_t event_time = 0;
+   AudioCallback::MidiRawData event;
+   bool pending = false;
+
+   auto start = chrono::steady_clock::now();
+
+   while (!stopped)
+   {
+      // Never more than one block ahead of the clock.
+      if (paced)
+         this_thread::sleep_until(start + chrono::microseconds(frame * 1000000 / sample_rate));
+
+      if (!pending)
+         pending = next_event(event_time, event, !paced);
+
+      unsigned frames = block_frames;
+      if (!pending && input_done)
+      {
+         if (!tail_end)
+            tail_end = max(event_time, frame) + max_tail_frames;
+         if (audio_cb->idle() || frame >= tail_end)
+            break;
+         frames = unsigned(min(tail_end - frame, uint64_t(block_frames)));
+      }
+
+      // Unpaced, nothing can sound before the next event, so silence is not rendered.
+      if (!paced && pending && event_time > frame && audio_cb->idle())
+      {
+         frames = unsigned(min(event_time - frame, uint64_t(block_frames)));
+         if (!write(frames, true))
+            break;
+         frame += frames;
+         continue;
+      }
+
+      while (pending && event_time < frame + frames)
+      {
+         audio_cb->process_midi(event, unsigned(event_time > frame ? event_time - frame : 0));
+         pending = next_event(event_time, event, !paced);
+      }
+
+      audio_cb->process_audio(buffer_ptrs.data(), amps.data(), frames);
+      if (!write(frames, false))
+         break;
+      frame += frames;
+   }
+
+   return frame;
+}
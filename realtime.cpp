@@ -0,0 +1,122 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "realtime.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+thread_local unsigned AllocationCheck::depth = 0;
+atomic<bool> AllocationCheck::enabled{false};
+atomic<uint64_t> AllocationCheck::heap_ops{0};
+
+bool RealTime::lock_memory()
+{
+#ifdef __linux__
+   rlimit limit;
+   if (geteuid() != 0 && (getrlimit(RLIMIT_MEMLOCK, &limit) != 0 || limit.rlim_cur != RLIM_INFINITY))
+   {
+      fprintf(stderr, "Not locking memory, RLIMIT_MEMLOCK is not unlimited. "
+            "See \"memlock\" in /etc/security/limits.conf.\n");
+      return false;
+   }
+
+   if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+   {
+      fprintf(stderr, "Failed to lock memory: %s.\n", strerror(errno));
+      return false;
+   }
+
+#ifdef __GLIBC__
+   mallopt(M_TRIM_THRESHOLD, -1);
+   mallopt(M_MMAP_MAX, 0);
+#endif
+
+   fprintf(stderr, "Locked memory.\n");
+   return true;
+#else
+   return false;
+#endif
+}
+
+#ifdef __linux__
+static void populate(uint8_t *start, uint8_t *end, size_t page)
+{
+#ifdef MADV_POPULATE_WRITE
+   if (madvise(start, end - start, MADV_POPULATE_WRITE) == 0)
+      return;
+#endif
+
+   // Adding zero writes without changing anything, even if another thread is using the page.
+   for (uint8_t *ptr = start; ptr < end; ptr += page)
+      __atomic_fetch_add(ptr, 0, __ATOMIC_RELAXED);
+}
+#endif
+
+void RealTime::prefault_memory()
+{
+#ifdef __linux__
+   FILE *maps = fopen("/proc/self/maps", "r");
+   if (!maps)
+      return;
+
+   size_t page = sysconf(_SC_PAGESIZE);
+   size_t total = 0;
+   char line[1024];
+   while (fgets(line, sizeof(line), maps))
+   {
+      unsigned long start, end;
+      char perms[5] = {};
+      char path[256] = {};
+      if (sscanf(line, "%lx-%lx %4s %*s %*s %*s %255s", &start, &end, perms, path) < 3)
+         continue;
+
+      bool anonymous = !*path || !strcmp(path, "[heap]") || !strncmp(path, "[anon", 5);
+      if (strcmp(perms, "rw-p") || !anonymous)
+         continue;
+
+      populate(reinterpret_cast<uint8_t*>(start), reinterpret_cast<uint8_t*>(end), page);
+      total += end - start;
+   }
+   fclose(maps);
+
+   fprintf(stderr, "Mapped in %.1f MiB of memory.\n", total / (1024.0 * 1024.0));
+#endif
+}
+
+void RealTime::prefault_stack()
+{
+   // The render path keeps a few KiB of staging buffers on the stack.
+   enum { stack_bytes = 64 * 1024, page = 4096 };
+   uint8_t stack[stack_bytes];
+   volatile uint8_t *touch = stack;
+   for (unsigned i = 0; i < stack_bytes; i += page)
+      touch[i] = 0;
+}
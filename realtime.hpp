@@ -0,0 +1,73 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef REALTIME_HPP__
+#define REALTIME_HPP__
+
+#include <atomic>
+#include <cstdint>
+
+// Keeps the audio threads from page faulting, see lock_memory().
+namespace RealTime
+{
+   // Locks all current and future memory of the process into RAM, and keeps freed
+   // memory in the heap instead of returning it, so it stays locked.
+   // Locking future mappings makes allocations fail past RLIMIT_MEMLOCK, so this is
+   // only done if the limit is unlimited, or as root. Returns false if not locked.
+   bool lock_memory();
+
+   // Maps in every page of private, writable memory which is not backed by a file:
+   // the heap, including reserved capacity nothing has touched yet, DSP tables,
+   // voice state and thread stacks. Contents are left as they are.
+   // The fallback when memory cannot be locked, which does the same.
+   void prefault_memory();
+
+   // Touches more stack than the render path uses, so it never faults growing into it.
+   // Call at the start of every audio thread.
+   void prefault_stack();
+}
+
+// Counts heap use through malloc() and friends on threads inside a check.
+// Audio threads keep one open around their work, which costs a thread-local
+// increment, and nothing is counted until enable() is called.
+class AllocationCheck
+{
+   public:
+      inline AllocationCheck() { depth++; }
+      inline ~AllocationCheck() { depth--; }
+
+      AllocationCheck(const AllocationCheck&) = delete;
+      void operator=(const AllocationCheck&) = delete;
+
+      static inline void enable(bool enable) { enabled.store(enable, std::memory_order_relaxed); }
+      // Allocations and frees inside checks while enabled, on any thread.
+      static inline uint64_t count() { return heap_ops.load(std::memory_order_relaxed); }
+
+      // Called by the replacement malloc() and free(), see allocation_check.cpp.
+      static inline void heap_used()
+      {
+         if (depth && enabled.load(std::memory_order_relaxed))
+            heap_ops.fetch_add(1, std::memory_order_relaxed);
+      }
+
+   private:
+      static thread_local unsigned depth;
+      static std::atomic<bool> enabled;
+      static std::atomic<uint64_t> heap_ops;
+};
+
+#endif
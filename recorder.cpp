@@ -0,0 +1,119 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "recorder.hpp"
+#include <cstdio>
+#include <stdexcept>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+Recorder::Recorder(const string &path, unsigned channels, unsigned sample_rate, float seconds)
+   : sink(path, channels, sample_rate), channels(channels), sample_rate(sample_rate)
+{
+   capacity = 1;
+   while (capacity < uint64_t(ceil(seconds * sample_rate)))
+      capacity <<= 1;
+
+   // Filled with zeros, so the ring is paged in before the audio thread writes to it.
+   ring.resize(capacity * channels);
+
+   thread = std::thread(&Recorder::writer_loop, this);
+}
+
+Recorder::~Recorder()
+{
+   dead = true;
+   thread.join();
+
+   uint64_t lost = dropped();
+   if (lost)
+      fprintf(stderr, "[recorder]: %.2f s of audio were dropped in total.\n", double(lost) / sample_rate);
+}
+
+void Recorder::push(const float * const *audio, unsigned frames)
+{
+   uint64_t pos = write_pos.load(memory_order_relaxed);
+   uint64_t free_frames = capacity - (pos - read_pos.load(memory_order_acquire));
+   if (frames > free_frames)
+   {
+      // The writer cannot keep up. Dropping the block leaves a gap, but never stalls audio.
+      dropped_frames.store(dropped_frames.load(memory_order_relaxed) + frames, memory_order_relaxed);
+      return;
+   }
+
+   for (unsigned i = 0; i < frames; i++)
+   {
+      float *frame = &ring[((pos + i) & (capacity - 1)) * channels];
+      for (unsigned c = 0; c < channels; c++)
+         frame[c] = audio[c][i];
+   }
+
+   write_pos.store(pos + frames, memory_order_release);
+}
+
+uint64_t Recorder::drain()
+{
+   uint64_t pos = read_pos.load(memory_order_relaxed);
+   uint64_t end = write_pos.load(memory_order_acquire);
+   uint64_t total = end - pos;
+
+   while (pos < end)
+   {
+      // Up to where the ring wraps around.
+      uint64_t offset = pos & (capacity - 1);
+      unsigned frames = unsigned(min(end - pos, capacity - offset));
+      sink.write(&ring[offset * channels], frames);
+      pos += frames;
+      read_pos.store(pos, memory_order_release);
+   }
+
+   return total;
+}
+
+void Recorder::writer_loop()
+{
+   uint64_t reported = 0;
+
+   try
+   {
+      while (!dead)
+      {
+         // The audio thread does not signal, it must not make system calls.
+         // The ring holds seconds of audio, so polling is plenty.
+         if (!drain())
+            this_thread::sleep_for(chrono::milliseconds(20));
+
+         uint64_t lost = dropped();
+         if (lost != reported)
+         {
+            fprintf(stderr, "[recorder]: Disk cannot keep up, %llu frames dropped so far.\n",
+                  static_cast<unsigned long long>(lost));
+            reported = lost;
+         }
+      }
+
+      drain();
+   }
+   catch (const exception &e)
+   {
+      // Audio keeps playing, the ring fills up and further blocks count as dropped.
+      fprintf(stderr, "[recorder]: Recording stopped: %s\n", e.what());
+   }
+}
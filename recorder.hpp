@@ -0,0 +1,74 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef RECORDER_HPP__
+#define RECORDER_HPP__
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "audio_sink.hpp"
+
+// Records audio from the real-time thread to a file. Blocks are copied into a
+// preallocated single-producer, single-consumer ring, and a background thread
+// encodes them with libsndfile, so the audio thread never touches the filesystem.
+//
+// If the disk falls behind by more than the ring holds, blocks are dropped rather
+// than waited for. Dropped frames are reported by the background thread.
+class Recorder
+{
+   public:
+      // The ring holds at least seconds of audio.
+      Recorder(const std::string &path, unsigned channels, unsigned sample_rate, float seconds = 4.0f);
+      // Writes out what is left in the ring and closes the file.
+      ~Recorder();
+
+      Recorder(Recorder&&) = delete;
+      void operator=(Recorder&&) = delete;
+
+      // Real-time safe. Called by the audio thread only.
+      void push(const float * const *audio, unsigned frames);
+
+      inline uint64_t dropped() const { return dropped_frames.load(std::memory_order_relaxed); }
+
+   private:
+      SndfileSink sink;
+      unsigned channels;
+      unsigned sample_rate;
+
+      // Interleaved, capacity frames, a power of two.
+      std::vector<float> ring;
+      uint64_t capacity;
+
+      // Positions count frames since the start and only ever grow.
+      // Kept on separate cache lines, each is written by one thread only.
+      std::atomic<uint64_t> write_pos{0};
+      char padding[64];
+      std::atomic<uint64_t> read_pos{0};
+      std::atomic<uint64_t> dropped_frames{0};
+
+      std::atomic<bool> dead{false};
+      std::thread thread;
+
+      void writer_loop();
+      // Writes out everything in the ring. Returns the frames written.
+      uint64_t drain();
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "audio_driver.hpp"
+#include "audio_sink.hpp"
+#include "trace.hpp"
+#include "denormal.hpp"
+#include "realtime.hpp"
+#include <stdexcept>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+
+using namespace std;
+
+ReplayDriver::ReplayDriver(shared_ptr<AudioCallback> cb, TraceReader &trace, AudioSink *sink)
+   : AudioDriver(move(cb)), trace(trace), sink(sink), channels(trace.channels())
+{
+   if (!channels)
+      throw runtime_error("Trace has no audio channels.");
+
+   unsigned buses = audio_cb->buses();
+   if (buses != trace.buses())
+      fprintf(stderr, "Trace was played on %u buses, replaying on %u.\n", trace.buses(), buses);
+
+   // Sized for the largest block up front, so nothing is allocated while timing.
+   unsigned frames = max(trace.max_frames(), 1u);
+   buffer.resize(buses * channels * frames);
+   interleaved.resize(buses * channels * frames);
+   for (unsigned c = 0; c < buses * channels; c++)
+      buffer_ptrs.push_back(buffer.data() + c * frames);
+   amps.insert(end(amps), channels, 1.0f);
+}
+
+void ReplayDriver::stop()
+{
+   stopped = true;
+}
+
+ReplayDriver::Result ReplayDriver::render()
+{
+   DenormalGuard denormal_guard;
+
+   Result result = {};
+   unsigned sample_rate = 0;
+   unsigned total_channels = buffer_ptrs.size();
+   auto position = [&]() -> double {
+      return sample_rate ? double(result.frames) / sample_rate : 0.0;
+   };
+
+   // Heap use of events is charged to the block they belong to.
+   uint64_t heap_ops = AllocationCheck::count();
+
+   trace.rewind();
+   TraceReader::Entry entry;
+   while (!stopped && trace.next(entry))
+   {
+      if (entry.midi)
+      {
+         AllocationCheck allocation_check;
+         audio_cb->process_midi(AudioCallback::get_event(entry.raw, entry.value));
+         continue;
+      }
+
+      switch (entry.type)
+      {
+         case Trace::Record::SampleRate:
+            sample_rate = entry.value;
+            audio_cb->configure_audio(sample_rate, channels);
+            break;
+
+         case Trace::Record::BufferSize:
+            audio_cb->configure_buffer_size(entry.value);
+            break;
+
+         case Trace::Record::Xrun:
+            fprintf(stderr, "[replay]: Xrun live at %.3f s.\n", position());
+            result.xruns += entry.value;
+            break;
+
+         case Trace::Record::Dropped:
+            fprintf(stderr, "[replay]: %u records are missing at %.3f s, replay differs from live after this.\n",
+                  entry.value, position());
+            break;
+
+         case Trace::Record::Block:
+         {
+            unsigned frames = entry.value;
+            if (!frames)
+               break;
+
+            auto start = chrono::steady_clock::now();
+            {
+               AllocationCheck allocation_check;
+               audio_cb->process_buses(buffer_ptrs.data(), amps.data(), frames);
+            }
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            if (AllocationCheck::count() != heap_ops)
+            {
+               if (!result.allocating_blocks)
+               {
+                  result.first_allocating_block = result.blocks;
+                  fprintf(stderr, "[replay]: Block %llu at %.3f s touched the heap.\n",
+                        static_cast<unsigned long long>(result.blocks), position());
+               }
+               result.allocating_blocks++;
+               heap_ops = AllocationCheck::count();
+            }
+
+            // Compared against the period the block had to finish in live.
+            double load = sample_rate ? elapsed * sample_rate / frames : 0.0;
+            if (load > 1.0)
+               result.late_blocks++;
+            if (load > result.worst_load)
+            {
+               result.worst_load = load;
+               result.worst_block = result.blocks;
+               result.worst_frame = result.frames;
+            }
+
+            if (sink)
+            {
+               for (unsigned c = 0; c < total_channels; c++)
+                  for (unsigned i = 0; i < frames; i++)
+                     interleaved[i * total_channels + c] = buffer_ptrs[c][i];
+               sink->write(interleaved.data(), frames);
+            }
+
+            result.seconds += elapsed;
+            result.blocks++;
+            result.frames += frames;
+            break;
+         }
+
+         default:
+            // Nothing else affects rendering.
+            break;
+      }
+   }
+
+   return result;
+}
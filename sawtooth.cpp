@@ -4,12 +4,15 @@
 using namespace std;
 
 std::vector<blipper_sample_t> Sawtooth::filter_bank;
+std::vector<blipper_sample_t> Sawtooth::reduced_filter_bank;
+DenormalCounter Sawtooth::denormals{"Sawtooth"};
+
 Sawtooth::Sawtooth()
    : filter({}, {})
 {
    if (filter_bank.empty())
       init_filter();
-   blip = blipper_new(64, 0.85, 8.0, 64, 16 * 1024, filter_bank.data());
+   blip = blipper_new(64, 0.85, 8.0, 64, max_frames + max_period / 64, filter_bank.data());
 }
 
 Sawtooth::~Sawtooth()
@@ -23,6 +26,9 @@ Sawtooth& Sawtooth::operator=(Sawtooth&& saw)
    blip = saw.blip;
    delta = saw.delta;
    period = saw.period;
+   base_period = saw.base_period;
+   pitch = saw.pitch;
+   rendered_quality = saw.rendered_quality;
    filter = move(saw.filter);
    saw.blip = nullptr;
    return *this;
@@ -38,6 +44,20 @@ void Sawtooth::init_filter()
    blipper_sample_t *filt = blipper_create_filter_bank(64, 64, 0.85, 8.0);
    filter_bank.insert(end(filter_bank), filt, filt + 64 * 64);
    free(filt);
+
+   filt = blipper_create_filter_bank(64, reduced_taps, 0.7, 6.0);
+   reduced_filter_bank.insert(end(reduced_filter_bank), filt, filt + 64 * reduced_taps);
+   free(filt);
+}
+
+uint64_t Sawtooth::parameter_hash() const
+{
+   const unsigned geometry[] = { max_period, reduced_taps };
+   uint64_t hash = hash_bytes(geometry, sizeof(geometry));
+   hash = hash_bytes(filter_bank.data(), filter_bank.size() * sizeof(blipper_sample_t), hash);
+   hash = hash_bytes(reduced_filter_bank.data(),
+         reduced_filter_bank.size() * sizeof(blipper_sample_t), hash);
+   return filter.hash(hash);
 }
 
 void Sawtooth::trigger(unsigned note, unsigned velocity, unsigned sample_rate, float detune)
@@ -47,25 +67,56 @@ void Sawtooth::trigger(unsigned note, unsigned velocity, unsigned sample_rate, f
    double freq = (1.0f + detune) * 440.0f * pow(2.0f, (note - 69.0f) / 12.0f);
 
    period = unsigned(round(sample_rate * 64 / freq)); 
-   if (period > 16 * 1024 * 64)
+   if (period > max_period)
    {
       active(false);
       return;
    }
+   base_period = period;
+   pitch = PitchRamp();
 
    delta = -0.2f;
    blipper_reset(blip);
+   blipper_set_filter_bank(blip, 0, nullptr);
+   rendered_quality = Quality::Full;
    blipper_push_delta(blip, -0.1f, 0);
 
    blipper_set_ramp(blip, 0.2f, period);
 }
 
-unsigned Sawtooth::render(float **out, const float *amp, unsigned frames, unsigned channels)
+void Sawtooth::set_pitch(const PitchCurve &curve)
+{
+   pitch.set(curve);
+}
+
+void Sawtooth::skip_pitch(unsigned frames)
+{
+   pitch.advance(frames);
+}
+
+unsigned Sawtooth::modulated_period(unsigned offset) const
+{
+   if (pitch.unity())
+      return base_period;
+
+   unsigned modulated = unsigned(base_period / pitch.at(offset) + 0.5f);
+   return max(min(modulated, unsigned(max_period)), 1u);
+}
+
+unsigned Sawtooth::render(const MixTarget &target, unsigned frames)
 {
    blipper_sample_t stage_buffer[256];
    blipper_sample_t env_buffer[256];
-   while (blipper_read_avail(blip) < frames)
-      blipper_push_delta(blip, delta, period);
+
+   // Only affects impulses pushed from now on, so switching never clicks.
+   if (quality() != rendered_quality)
+   {
+      rendered_quality = quality();
+      if (rendered_quality == Quality::Reduced)
+         blipper_set_filter_bank(blip, reduced_taps, reduced_filter_bank.data());
+      else
+         blipper_set_filter_bank(blip, 0, nullptr);
+   }
 
    unsigned s;
    for (s = 0; s < frames; )
@@ -73,7 +124,23 @@ unsigned Sawtooth::render(float **out, const float *amp, unsigned frames, unsign
       if (check_release_complete())
          break;
 
-      unsigned process_frames = min(256u, frames - s);
+      // The ramp applies to every sample read, so a cycle with another period is
+      // only pushed once everything before it has been read.
+      unsigned avail;
+      while ((avail = blipper_read_avail(blip)) < frames - s)
+      {
+         unsigned next = modulated_period(s + avail);
+         if (next != period)
+         {
+            if (avail)
+               break;
+            period = next;
+            blipper_set_ramp(blip, 0.2f, period);
+         }
+         blipper_push_delta(blip, delta, period);
+      }
+
+      unsigned process_frames = min(min(256u, frames - s), blipper_read_avail(blip));
       blipper_read(blip, stage_buffer, process_frames, 1);
 
       for (unsigned i = 0; i < process_frames; i++)
@@ -82,17 +149,15 @@ unsigned Sawtooth::render(float **out, const float *amp, unsigned frames, unsign
          step();
       }
 
-      for (unsigned c = 0; c < channels; c++)
-      {
-         float *buf = out[c] + s;
-         float amp_tmp = amp[c];
-         for (unsigned i = 0; i < process_frames; i++)
-            buf[i] += amp_tmp * env_buffer[i];
-      }
+      const float *src = env_buffer;
+      target.mix(s, &src, 1, process_frames);
 
       s += process_frames;
    }
 
+   denormals.hit(blipper_denormals(blip));
+   pitch.advance(s);
+
    return s;
 }
 
@@ -0,0 +1,481 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "server.hpp"
+#include "synth.hpp"
+#include "midi_file.hpp"
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace RenderProtocol;
+
+MemfdSink::MemfdSink(unsigned channels)
+   : channels(channels)
+{
+   fd = memfd_create("airsynth-render", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   if (fd < 0)
+      throw runtime_error(string("Failed to create memfd: ") + strerror(errno));
+}
+
+MemfdSink::~MemfdSink()
+{
+   if (map)
+      munmap(map, capacity);
+   if (fd >= 0)
+      close(fd);
+}
+
+void MemfdSink::reserve(size_t bytes)
+{
+   if (bytes <= capacity)
+      return;
+
+   // Grows geometrically, so long renders are not remapped for every block.
+   size_t new_capacity = max(max(capacity * 2, bytes), size_t(1) << 20);
+   if (ftruncate(fd, new_capacity) < 0)
+      throw runtime_error(string("Failed to grow memfd: ") + strerror(errno));
+
+   void *addr = map ?
+      mremap(map, capacity, new_capacity, MREMAP_MAYMOVE) :
+      mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (addr == MAP_FAILED)
+      throw runtime_error(string("Failed to map memfd: ") + strerror(errno));
+
+   map = static_cast<float*>(addr);
+   capacity = new_capacity;
+}
+
+void MemfdSink::write(const float *audio, unsigned frames)
+{
+   size_t offset = written * channels;
+   reserve((offset + size_t(frames) * channels) * sizeof(float));
+
+   // The file reads back as zeros where nothing was written,
+   // so silence costs neither copies nor memory.
+   if (audio)
+      copy(audio, audio + size_t(frames) * channels, map + offset);
+   written += frames;
+}
+
+int MemfdSink::release()
+{
+   // Writable mappings must be gone before the file can be sealed against writes.
+   if (map)
+      munmap(map, capacity);
+   map = nullptr;
+   capacity = 0;
+
+   if (ftruncate(fd, written * channels * sizeof(float)) < 0 ||
+         fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+      throw runtime_error(string("Failed to seal memfd: ") + strerror(errno));
+
+   int ret = fd;
+   fd = -1;
+   return ret;
+}
+
+static bool send_response(int fd, const Response &response, int memfd)
+{
+   iovec iov = { const_cast<Response*>(&response), sizeof(response) };
+   msghdr msg = {};
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+
+   union
+   {
+      cmsghdr header;
+      char buffer[CMSG_SPACE(sizeof(int))];
+   } control = {};
+
+   if (memfd >= 0)
+   {
+      msg.msg_control = control.buffer;
+      msg.msg_controllen = sizeof(control.buffer);
+      cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+   }
+
+   // The file descriptor goes with the first byte, the rest is sent plainly.
+   ssize_t ret;
+   do
+      ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+   while (ret < 0 && errno == EINTR);
+   if (ret <= 0)
+      return false;
+
+   auto ptr = reinterpret_cast<const uint8_t*>(&response) + ret;
+   size_t size = sizeof(response) - ret;
+   while (size)
+   {
+      ret = send(fd, ptr, size, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      ptr += ret;
+      size -= ret;
+   }
+   return true;
+}
+
+RenderServer::RenderServer(const string &path, unsigned num_workers, unsigned sample_rate,
+      const function<shared_ptr<AirSynth> ()> &make_synth)
+   : path(path), sample_rate(sample_rate)
+{
+   num_workers = max(num_workers, 1u);
+   queue_size = 2 * num_workers;
+
+   sockaddr_un addr = {};
+   addr.sun_family = AF_UNIX;
+   if (path.size() >= sizeof(addr.sun_path))
+      throw runtime_error("Socket path too long: " + path);
+   strcpy(addr.sun_path, path.c_str());
+
+   // Every synth is built and pre-warmed before the first client is accepted.
+   workers.resize(num_workers);
+   for (auto &worker : workers)
+   {
+      worker.synth = make_synth();
+      for (unsigned channel = 0; channel < Synthesizer::num_midi_channels; channel++)
+         worker.programs.push_back(worker.synth->get_program(channel));
+   }
+
+   wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if (wake_fd < 0)
+      throw runtime_error(string("Failed to create eventfd: ") + strerror(errno));
+
+   listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (listen_fd < 0)
+   {
+      int err = errno;
+      close(wake_fd);
+      throw runtime_error(string("Failed to create socket: ") + strerror(err));
+   }
+
+   // A socket left behind by an earlier server would make bind() fail.
+   unlink(path.c_str());
+   if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+         listen(listen_fd, queue_size) < 0)
+   {
+      int err = errno;
+      close(listen_fd);
+      close(wake_fd);
+      throw runtime_error("Failed to listen on " + path + ": " + strerror(err));
+   }
+}
+
+RenderServer::~RenderServer()
+{
+   close(wake_fd);
+   close(listen_fd);
+   unlink(path.c_str());
+}
+
+void RenderServer::wake()
+{
+   uint64_t one = 1;
+   ssize_t ret = write(wake_fd, &one, sizeof(one));
+   (void)ret;
+}
+
+void RenderServer::stop()
+{
+   // Only wakes up run(), nothing else here is allowed in a signal handler.
+   stopped = true;
+   wake();
+}
+
+void RenderServer::run()
+{
+   for (auto &worker : workers)
+      worker.thread = thread(&RenderServer::worker_loop, this, ref(worker));
+
+   fprintf(stderr, "Serving on %s with %u workers.\n", path.c_str(), unsigned(workers.size()));
+   auto start = chrono::steady_clock::now();
+
+   vector<pollfd> fds;
+   vector<Connection*> polled;
+   while (!stopped)
+   {
+      bool full;
+      {
+         lock_guard<mutex> hold(lock);
+         for (auto connection : finished)
+            connection->busy = false;
+         finished.clear();
+         full = pending.size() >= queue_size;
+      }
+
+      for (auto itr = begin(connections); itr != end(connections); )
+      {
+         if (!itr->busy && itr->closing)
+         {
+            close(itr->fd);
+            itr = connections.erase(itr);
+         }
+         else
+            ++itr;
+      }
+
+      // Nothing is read while the queue is full, workers wake us up when they take a job.
+      fds.clear();
+      polled.clear();
+      fds.push_back({ wake_fd, POLLIN, 0 });
+      if (!full)
+      {
+         if (connections.size() < max_connections)
+            fds.push_back({ listen_fd, POLLIN, 0 });
+         for (auto &connection : connections)
+         {
+            if (connection.busy || connection.closing)
+               continue;
+            fds.push_back({ connection.fd, POLLIN, 0 });
+            polled.push_back(&connection);
+         }
+      }
+
+      if (poll(fds.data(), fds.size(), -1) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         fprintf(stderr, "Failed to poll clients: %s\n", strerror(errno));
+         break;
+      }
+
+      if (fds[0].revents)
+      {
+         uint64_t count;
+         ssize_t ret = read(wake_fd, &count, sizeof(count));
+         (void)ret;
+      }
+
+      for (size_t i = fds.size() - polled.size(); i < fds.size(); i++)
+      {
+         if (!fds[i].revents)
+            continue;
+
+         auto &connection = *polled[i - (fds.size() - polled.size())];
+         if (!read_request(connection))
+            connection.closing = true;
+         else if (connection.received == sizeof(Request) + connection.midi.size())
+         {
+            connection.busy = true;
+            lock_guard<mutex> hold(lock);
+            pending.push_back(&connection);
+            cond.notify_one();
+         }
+      }
+
+      if (fds.size() > polled.size() + 1 && fds[1].revents)
+      {
+         int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+         if (fd < 0)
+         {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+            {
+               fprintf(stderr, "Failed to accept client: %s\n", strerror(errno));
+               break;
+            }
+            continue;
+         }
+
+         // A client which stops reading its responses cannot hold a worker for long.
+         timeval timeout = { send_timeout_secs, 0 };
+         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+         connections.emplace_back();
+         connections.back().fd = fd;
+      }
+   }
+
+   // Clients waiting for more jobs are hung up on, jobs in progress finish.
+   {
+      lock_guard<mutex> hold(lock);
+      shutdown = true;
+      cond.notify_all();
+   }
+   for (auto &worker : workers)
+      worker.thread.join();
+
+   for (auto &connection : connections)
+      close(connection.fd);
+   connections.clear();
+   pending.clear();
+   finished.clear();
+
+   double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+   fprintf(stderr, "Served %llu jobs (%llu failed), %.1f s of audio in %.1f s, %.1f jobs/s.\n",
+         static_cast<unsigned long long>(jobs.load()),
+         static_cast<unsigned long long>(failed.load()),
+         audio_usecs.load() * 1e-6, elapsed,
+         jobs.load() / max(elapsed, 1e-6));
+}
+
+void RenderServer::worker_loop(Worker &worker)
+{
+   for (;;)
+   {
+      Connection *connection;
+      {
+         unique_lock<mutex> hold(lock);
+         cond.wait(hold, [this] { return shutdown || !pending.empty(); });
+         if (shutdown)
+            return;
+         connection = pending.front();
+         pending.pop_front();
+      }
+      wake();
+
+      bool ok = serve_job(worker, *connection);
+
+      {
+         lock_guard<mutex> hold(lock);
+         connection->received = 0;
+         connection->closing = !ok;
+         finished.push_back(connection);
+      }
+      wake();
+   }
+}
+
+// Reads whatever has arrived without blocking. The connection is closed on false.
+bool RenderServer::read_request(Connection &connection)
+{
+   for (;;)
+   {
+      uint8_t *ptr;
+      size_t size;
+      if (connection.received < sizeof(Request))
+      {
+         ptr = reinterpret_cast<uint8_t*>(&connection.request) + connection.received;
+         size = sizeof(Request) - connection.received;
+      }
+      else
+      {
+         size_t offset = connection.received - sizeof(Request);
+         ptr = connection.midi.data() + offset;
+         size = connection.midi.size() - offset;
+      }
+
+      if (!size)
+         return true;
+
+      ssize_t ret = recv(connection.fd, ptr, size, MSG_DONTWAIT);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         return true;
+      if (ret <= 0)
+         return false;
+
+      connection.received += ret;
+      if (connection.received != sizeof(Request))
+         continue;
+
+      const Request &request = connection.request;
+      unsigned rate = request.sample_rate ? request.sample_rate : sample_rate;
+      if (request.magic != request_magic || request.midi_size > max_midi_size ||
+            rate < 8000 || rate > 192000)
+      {
+         // The stream cannot be trusted to be in sync any more.
+         Response response = {};
+         response.magic = response_magic;
+         response.status = Status::BadRequest;
+         response.channels = channels;
+         response.sample_rate = rate;
+         send_response(connection.fd, response, -1);
+         failed++;
+         return false;
+      }
+      connection.midi.resize(request.midi_size);
+   }
+}
+
+void RenderServer::reset(Worker &worker)
+{
+   for (unsigned channel = 0; channel < Synthesizer::num_midi_channels; channel++)
+      worker.synth->set_program(channel, worker.programs[channel]);
+   worker.synth->reset();
+}
+
+bool RenderServer::serve_job(Worker &worker, const Connection &connection)
+{
+   int fd = connection.fd;
+   const Request &request = connection.request;
+   const vector<uint8_t> &midi = connection.midi;
+
+   Response response = {};
+   response.magic = response_magic;
+   response.channels = channels;
+   response.sample_rate = request.sample_rate ? request.sample_rate : sample_rate;
+
+   int memfd = -1;
+   try
+   {
+      unique_ptr<MidiFile> file;
+      try
+      {
+         file.reset(new MidiFile(midi.data(), midi.size()));
+      }
+      catch (const exception &)
+      {
+         response.status = Status::BadMidi;
+         failed++;
+         return send_response(fd, response, -1);
+      }
+
+      MemfdSink sink(channels);
+      OfflineDriver driver(worker.synth, *file, sink, channels, response.sample_rate);
+      driver.max_tail = max_tail;
+      driver.render();
+      reset(worker);
+
+      response.frames = sink.frames();
+      memfd = sink.release();
+      response.status = Status::OK;
+   }
+   catch (const exception &e)
+   {
+      fprintf(stderr, "Render job failed: %s\n", e.what());
+      reset(worker);
+      response.status = Status::Failed;
+      failed++;
+      return send_response(fd, response, -1);
+   }
+
+   jobs++;
+   audio_usecs += response.frames * 1000000 / response.sample_rate;
+   bool ret = send_response(fd, response, memfd);
+   close(memfd);
+   return ret;
+}
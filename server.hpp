@@ -0,0 +1,183 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef SERVER_HPP__
+#define SERVER_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "audio_sink.hpp"
+
+class AirSynth;
+
+// Wire format of the render service. A client connects to the Unix socket and sends
+// any number of jobs, each a Request followed by midi_size bytes of Standard MIDI File.
+// Jobs are answered in order with a Response. Rendered audio is attached to it as a
+// sealed memfd (SCM_RIGHTS) holding frames * channels interleaved floats.
+namespace RenderProtocol
+{
+   enum : uint32_t
+   {
+      request_magic = 0x51524941,  // "AIRQ"
+      response_magic = 0x53524941, // "AIRS"
+   };
+
+   struct Request
+   {
+      uint32_t magic;
+      uint32_t sample_rate; // 0 uses the default rate of the server.
+      uint32_t midi_size;
+      uint32_t reserved;
+   };
+
+   enum class Status : uint32_t
+   {
+      OK,
+      BadRequest, // The connection is closed after this.
+      BadMidi,
+      Failed
+   };
+
+   struct Response
+   {
+      uint32_t magic;
+      Status status;
+      uint32_t sample_rate;
+      uint32_t channels;
+      uint64_t frames;
+   };
+}
+
+// Audio in an anonymous shared memory file, which is handed to another process
+// instead of copying the audio through a socket.
+class MemfdSink : public AudioSink
+{
+   public:
+      MemfdSink(unsigned channels);
+      ~MemfdSink();
+
+      MemfdSink(MemfdSink&&) = delete;
+      void operator=(MemfdSink&&) = delete;
+
+      void write(const float *audio, unsigned frames) override;
+
+      // Trims the file to the frames written and seals it read-only.
+      // The caller owns the returned file descriptor.
+      int release();
+
+      inline uint64_t frames() const { return written; }
+
+   private:
+      int fd = -1;
+      float *map = nullptr;
+      size_t capacity = 0;
+      unsigned channels;
+      uint64_t written = 0;
+
+      void reserve(size_t bytes);
+};
+
+// Renders MIDI files for other processes, see RenderProtocol. Every worker owns a
+// synth which stays warm between jobs, so filter banks and voice pools are only
+// built at startup.
+//
+// Requests are read by the thread in run() as they arrive, and only complete jobs
+// are queued for the workers, so a client holds a worker only while its job renders.
+// Jobs of one connection are served one at a time, in order. While queue_size jobs
+// wait for a worker, nothing more is read, and further clients wait in the listen
+// backlog, and then in connect(), until workers catch up.
+class RenderServer
+{
+   public:
+      RenderServer(const std::string &path, unsigned workers, unsigned sample_rate,
+            const std::function<std::shared_ptr<AirSynth> ()> &make_synth);
+      ~RenderServer();
+
+      RenderServer(RenderServer&&) = delete;
+      void operator=(RenderServer&&) = delete;
+
+      // Serves clients until stop() is called. Jobs in progress are finished.
+      void run();
+      // Safe to call from a signal handler.
+      void stop();
+
+      enum { channels = 2, max_midi_size = 16 << 20, max_connections = 256 };
+
+      // See OfflineDriver::max_tail.
+      float max_tail = 10.0f;
+
+   private:
+      std::string path;
+      int listen_fd = -1;
+      // Written by stop() and workers to wake up run().
+      int wake_fd = -1;
+      unsigned sample_rate;
+      unsigned queue_size;
+      std::atomic<bool> stopped{false};
+
+      enum { send_timeout_secs = 10 };
+
+      struct Worker
+      {
+         std::shared_ptr<AirSynth> synth;
+         // Programs of the parts when idle, restored after every job.
+         std::vector<unsigned> programs;
+         std::thread thread;
+      };
+      std::vector<Worker> workers;
+
+      // Owned by run(). While busy, the request belongs to the worker serving it.
+      struct Connection
+      {
+         int fd;
+         RenderProtocol::Request request;
+         std::vector<uint8_t> midi;
+         size_t received = 0;
+         bool busy = false;
+         bool closing = false;
+      };
+      std::list<Connection> connections;
+
+      std::mutex lock;
+      std::condition_variable cond;
+      std::deque<Connection*> pending;
+      // Connections whose job is done, handed back to run().
+      std::vector<Connection*> finished;
+      bool shutdown = false;
+
+      std::atomic<uint64_t> jobs{0};
+      std::atomic<uint64_t> failed{0};
+      std::atomic<uint64_t> audio_usecs{0};
+
+      void worker_loop(Worker &worker);
+      bool read_request(Connection &connection);
+      bool serve_job(Worker &worker, const Connection &connection);
+      void reset(Worker &worker);
+      void wake();
+};
+
+#endif
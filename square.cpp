@@ -4,12 +4,15 @@
 using namespace std;
 
 std::vector<blipper_sample_t> Square::filter_bank;
+std::vector<blipper_sample_t> Square::reduced_filter_bank;
+DenormalCounter Square::denormals{"Square"};
+
 Square::Square()
    : filter({}, {})
 {
    if (filter_bank.empty())
       init_filter();
-   blip = blipper_new(64, 0.85, 8.0, 64, 16 * 1024, filter_bank.data());
+   blip = blipper_new(64, 0.85, 8.0, 64, max_frames + max_period / 64, filter_bank.data());
 }
 
 Square::~Square()
@@ -23,6 +26,9 @@ Square& Square::operator=(Square&& square)
    blip = square.blip;
    delta = square.delta;
    period = square.period;
+   base_period = square.base_period;
+   pitch = square.pitch;
+   rendered_quality = square.rendered_quality;
    filter = move(square.filter);
    square.blip = nullptr;
    return *this;
@@ -38,6 +44,20 @@ void Square::init_filter()
    blipper_sample_t *filt = blipper_create_filter_bank(64, 64, 0.85, 8.0);
    filter_bank.insert(end(filter_bank), filt, filt + 64 * 64);
    free(filt);
+
+   filt = blipper_create_filter_bank(64, reduced_taps, 0.7, 6.0);
+   reduced_filter_bank.insert(end(reduced_filter_bank), filt, filt + 64 * reduced_taps);
+   free(filt);
+}
+
+uint64_t Square::parameter_hash() const
+{
+   const unsigned geometry[] = { max_period, reduced_taps };
+   uint64_t hash = hash_bytes(geometry, sizeof(geometry));
+   hash = hash_bytes(filter_bank.data(), filter_bank.size() * sizeof(blipper_sample_t), hash);
+   hash = hash_bytes(reduced_filter_bank.data(),
+         reduced_filter_bank.size() * sizeof(blipper_sample_t), hash);
+   return filter.hash(hash);
 }
 
 void Square::trigger(unsigned note, unsigned velocity, unsigned sample_rate, float detune)
@@ -47,23 +67,58 @@ void Square::trigger(unsigned note, unsigned velocity, unsigned sample_rate, flo
    float freq = (1.0f + detune) * 440.0f * pow(2.0f, (note - 69.0f) / 12.0f);
 
    period = unsigned(round(sample_rate * 64 / (2.0 * freq))); 
-   if (period > 16 * 1024 * 64)
+   if (period > max_period)
    {
       active(false);
       return;
    }
+   base_period = period;
+   pitch = PitchRamp();
 
    delta = 0.5f;
    blipper_reset(blip);
+   blipper_set_filter_bank(blip, 0, nullptr);
+   rendered_quality = Quality::Full;
    blipper_push_delta(blip, -0.25f, 0);
 }
 
-unsigned Square::render(float **out, const float *amp, unsigned frames, unsigned channels)
+void Square::set_pitch(const PitchCurve &curve)
+{
+   pitch.set(curve);
+}
+
+void Square::skip_pitch(unsigned frames)
+{
+   pitch.advance(frames);
+}
+
+unsigned Square::modulated_period(unsigned offset) const
+{
+   if (pitch.unity())
+      return base_period;
+
+   unsigned modulated = unsigned(base_period / pitch.at(offset) + 0.5f);
+   return max(min(modulated, unsigned(max_period)), 1u);
+}
+
+unsigned Square::render(const MixTarget &target, unsigned frames)
 {
    blipper_sample_t stage_buffer[256];
    blipper_sample_t env_buffer[256];
+
+   // Only affects impulses pushed from now on, so switching never clicks.
+   if (quality() != rendered_quality)
+   {
+      rendered_quality = quality();
+      if (rendered_quality == Quality::Reduced)
+         blipper_set_filter_bank(blip, reduced_taps, reduced_filter_bank.data());
+      else
+         blipper_set_filter_bank(blip, 0, nullptr);
+   }
+
    while (blipper_read_avail(blip) < frames)
    {
+      period = modulated_period(blipper_read_avail(blip));
       blipper_push_delta(blip, delta, period);
       delta = -delta;
    }
@@ -83,17 +138,15 @@ unsigned Square::render(float **out, const float *amp, unsigned frames, unsigned
          step();
       }
 
-      for (unsigned c = 0; c < channels; c++)
-      {
-         float *buf = out[c] + s;
-         float amp_tmp = amp[c];
-         for (unsigned i = 0; i < process_frames; i++)
-            buf[i] += amp_tmp * env_buffer[i];
-      }
+      const float *src = env_buffer;
+      target.mix(s, &src, 1, process_frames);
 
       s += process_frames;
    }
 
+   denormals.hit(blipper_denormals(blip));
+   pitch.advance(s);
+
    return s;
 }
 
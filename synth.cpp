@@ -16,32 +16,63 @@
 
 #include "synth.hpp"
 #include <cmath>
+#include <cstdio>
 #include <algorithm>
+#include <thread>
+#include <stdexcept>
+#include <string>
 
 using namespace std;
 
 static PolyphaseBank filter_bank;
+DenormalCounter Envelope::denormals{"Envelope"};
 
 AirSynth::AirSynth()
 {
-   instrument.init<NoiseIIR>(32, &filter_bank);
+   // Default bank. Every part starts out on program 0.
+   add_program<Sawtooth>(1, 32, 4);
+   add_program<Square>(2, 32, 4);
+   set_voices<NoiseIIR>(32, &filter_bank);
 }
 
 void Synthesizer::process_midi(MidiEvent data)
 {
+   unsigned frame = data.frame - data.frame % event_grid;
+
    switch (data.event)
    {
       case Event::NoteOn:
-         set_note(data.lo, data.hi);
+         set_note(data.channel, data.lo, data.hi, frame);
          break;
 
       case Event::NoteOff:
-         set_note(data.lo, 0);
+         set_note(data.channel, data.lo, 0, frame);
          break;
 
       case Event::Control:
          if (data.lo == 64) // Sustain controller on my CP33.
-            set_sustain(data.hi);
+         {
+            bool pedal = data.hi;
+            if (pedal != sustain_pedal[data.channel])
+            {
+               sustain_pedal[data.channel] = pedal;
+               set_sustain(data.channel, pedal, frame);
+            }
+         }
+         else
+            set_control(data.channel, data.lo, data.hi, frame);
+         break;
+
+      case Event::ChannelPressure:
+         set_pressure(data.channel, data.lo, frame);
+         break;
+
+      case Event::PitchWheel:
+         set_pitch_bend(data.channel, data.lo | (data.hi << 7), frame);
+         break;
+
+      case Event::Program:
+         set_program(data.channel, data.lo, frame);
          break;
 
       default:
@@ -49,62 +80,923 @@ void Synthesizer::process_midi(MidiEvent data)
    }
 }
 
-void AirSynth::set_note(unsigned note, unsigned velocity)
+void AirSynth::set_note(unsigned channel, unsigned note, unsigned velocity, unsigned frame)
+{
+   Instrument *instrument = parts[channel].instrument.load(memory_order_relaxed);
+   if (instrument)
+      instrument->set_note(note, velocity, sample_rate, frame);
+}
+
+void AirSynth::set_sustain(unsigned channel, bool sustain, unsigned frame)
+{
+   Instrument *instrument = parts[channel].instrument.load(memory_order_relaxed);
+   if (instrument)
+      instrument->set_sustain(sustain, frame);
+}
+
+void AirSynth::set_pitch_bend(unsigned channel, unsigned value, unsigned frame)
+{
+   Instrument *instrument = parts[channel].instrument.load(memory_order_relaxed);
+   if (instrument)
+      instrument->set_pitch_bend(value, frame);
+}
+
+void AirSynth::set_pressure(unsigned channel, unsigned value, unsigned frame)
+{
+   Instrument *instrument = parts[channel].instrument.load(memory_order_relaxed);
+   if (instrument)
+      instrument->set_pressure(value, frame);
+}
+
+void AirSynth::set_control(unsigned channel, unsigned controller, unsigned value, unsigned frame)
+{
+   Instrument *instrument = parts[channel].instrument.load(memory_order_relaxed);
+   if (instrument)
+      instrument->set_control(controller, value, frame);
+}
+
+void AirSynth::set_program(unsigned channel, unsigned program, unsigned frame)
+{
+   if (program >= num_programs)
+      return;
+
+   auto &part = parts[channel];
+   Instrument *old = part.instrument.load(memory_order_relaxed);
+   if (old && part.program.load(memory_order_relaxed) == program)
+      return;
+
+   auto &prog = programs[program];
+   if (prog.free.empty())
+      return;
+
+   Instrument *next = prog.free.back();
+   prog.free.pop_back();
+   next->set_sustain(sustain_pedal[channel], frame);
+   if (old)
+      next->inherit_modulation(*old);
+
+   // The old program keeps rendering until its released notes have died out.
+   // Capacity for every instance is reserved up front, so this never allocates.
+   if (old)
+   {
+      old->release_all(frame);
+      draining.push_back({old, part.program.load(memory_order_relaxed), channel});
+   }
+
+   part.program.store(program, memory_order_relaxed);
+   part.instrument.store(next, memory_order_release);
+}
+
+void AirSynth::remove_program(unsigned program)
+{
+   auto &prog = programs[program];
+   for (auto &part : parts)
+   {
+      if (part.instrument.load(memory_order_relaxed) &&
+            part.program.load(memory_order_relaxed) == program)
+         part.instrument.store(nullptr, memory_order_relaxed);
+   }
+
+   draining.erase(remove_if(begin(draining), end(draining), [program](const Draining &drain) {
+            return drain.program == program;
+         }), end(draining));
+
+   prog.free.clear();
+   prog.instances.clear();
+   update_program_buses();
+}
+
+void AirSynth::setup_program(unsigned program)
+{
+   auto &prog = programs[program];
+   prog.free.reserve(prog.instances.size());
+
+   // Free list is popped from the back, hand out the first instance first.
+   for (auto itr = prog.instances.rbegin(); itr != prog.instances.rend(); ++itr)
+   {
+      auto &instrument = **itr;
+      instrument.set_silence_threshold(silence_db);
+      instrument.set_steal_policy(steal_policy);
+      instrument.set_lod_threshold(lod_db + (lod_pressure ? lod_pressure_db : 0.0f));
+      instrument.set_worker_pool(workers.get(), channels);
+      instrument.set_sample_rate(sample_rate);
+      instrument.prewarm(sample_rate);
+      prog.free.push_back(&instrument);
+   }
+
+   unsigned instances = 0;
+   for_each_instance([&](Instrument&) { instances++; });
+   draining.reserve(instances);
+
+   allocate_part_buffers();
+   configure_governor();
+   update_program_buses();
+}
+
+void AirSynth::recycle_drained()
+{
+   unsigned kept = 0;
+   for (auto &drain : draining)
+   {
+      if (drain.instrument->idle())
+      {
+         drain.instrument->reset();
+         programs[drain.program].free.push_back(drain.instrument);
+      }
+      else
+         draining[kept++] = drain;
+   }
+   draining.resize(kept);
+}
+
+void AirSynth::reset()
+{
+   for_each_instance([](Instrument &instrument) {
+      instrument.reset();
+   });
+   recycle_drained();
+   fill(begin(sustain_pedal), end(sustain_pedal), false);
+}
+
+unique_ptr<VoicePoolBase> AirSynth::create_voices(unsigned program, unsigned voices) const
+{
+   if (!has_program(program))
+      return {};
+   return programs[program].instances.front()->create_voices(voices);
+}
+
+void AirSynth::set_silence_threshold(float db)
+{
+   silence_db = db;
+   for_each_instance([db](Instrument &instrument) {
+      instrument.set_silence_threshold(db);
+   });
+}
+
+void AirSynth::set_steal_policy(const StealPolicy &policy)
+{
+   steal_policy = policy;
+   for_each_instance([&policy](Instrument &instrument) {
+      instrument.set_steal_policy(policy);
+   });
+}
+
+void AirSynth::set_envelope(unsigned program, float gain, float attack, float delay,
+      float sustain_level, float release)
+{
+   for (auto &instrument : programs[program].instances)
+      instrument->set_envelope(gain, attack, delay, sustain_level, release);
+}
+
+void AirSynth::set_lod_threshold(float db)
+{
+   lod_db = db;
+   lod_pressure = false;
+   for_each_instance([db](Instrument &instrument) {
+      instrument.set_lod_threshold(db);
+   });
+}
+
+void AirSynth::update_lod_pressure()
+{
+   bool pressure = governor.get_stats().load.load(memory_order_relaxed) > governor.target_load;
+   if (pressure != lod_pressure)
+   {
+      lod_pressure = pressure;
+      float db = lod_db + (pressure ? lod_pressure_db : 0.0f);
+      for_each_instance([db](Instrument &instrument) {
+         instrument.set_lod_threshold(db);
+      });
+   }
+}
+
+void AirSynth::set_threads(unsigned threads, int rt_priority)
 {
-   instrument.set_note(note, velocity, sample_rate);
+   for_each_instance([this](Instrument &instrument) {
+      instrument.set_worker_pool(nullptr, channels);
+   });
+   workers.reset();
+
+   // Oversubscribing cores only makes the audio thread wait on preempted workers.
+   unsigned cores = thread::hardware_concurrency();
+   if (cores && threads > cores)
+   {
+      fprintf(stderr, "Limiting render threads to %u cores.\n", cores);
+      threads = cores;
+   }
+
+   if (threads)
+   {
+      workers.reset(new WorkerPool(threads - 1, rt_priority));
+      for_each_instance([this](Instrument &instrument) {
+         instrument.set_worker_pool(workers.get(), channels);
+      });
+   }
+   allocate_part_buffers();
+}
+
+void AirSynth::configure_audio(unsigned sample_rate, unsigned channels)
+{
+   if (channels > Voice::max_channels)
+      throw runtime_error("Too many audio channels for AirSynth.");
+
+   Synthesizer::configure_audio(sample_rate, channels);
+   for_each_instance([sample_rate](Instrument &instrument) {
+      instrument.set_sample_rate(sample_rate);
+   });
+   for_each_instance([this, channels](Instrument &instrument) {
+      instrument.set_worker_pool(workers.get(), channels);
+   });
+   allocate_part_buffers();
+   configure_governor();
+}
+
+void AirSynth::configure_buffer_size(unsigned frames)
+{
+   period_frames = frames;
+   configure_governor();
+}
+
+void AirSynth::allocate_part_buffers()
+{
+   // Every instance may be playing or draining at once.
+   unsigned instances = 0;
+   for_each_instance([&](Instrument&) { instances++; });
+   rendering.reserve(instances);
+
+   part_channels = channels;
+   part_buffers.resize(instances * part_channels * Instrument::max_job_frames);
+   part_outputs.resize(instances * part_channels);
+   job_outputs.resize(instances * part_channels);
+   for (unsigned i = 0; i < part_outputs.size(); i++)
+      part_outputs[i] = part_buffers.data() + i * Instrument::max_job_frames;
+}
+
+unsigned AirSynth::polyphony() const
+{
+   unsigned voices = 0;
+   for (auto &part : parts)
+   {
+      Instrument *instrument = part.instrument.load(memory_order_relaxed);
+      if (instrument)
+         voices += instrument->get_polyphony();
+   }
+   return voices;
+}
+
+unsigned AirSynth::sounding() const
+{
+   unsigned voices = 0;
+   for_each_playing([&](Instrument &instrument) {
+      voices += instrument.sounding();
+   });
+   return voices;
+}
+
+void AirSynth::configure_governor()
+{
+   governor.configure(sample_rate, period_frames, polyphony());
+   set_voice_limit(polyphony());
+}
+
+unsigned AirSynth::set_voice_limit(unsigned limit)
+{
+   voice_limit = limit;
+
+   // No single part may exceed the total. Beyond that, shed the least audible
+   // voices of the whole synth, whichever part they belong to.
+   unsigned shed = 0;
+   for_each_instance([&](Instrument &instrument) {
+      shed += instrument.set_voice_limit(limit);
+   });
+
+   for (unsigned voices = sounding(); voices > limit; voices--)
+   {
+      Instrument *quietest = nullptr;
+      float quietest_level = 0.0f;
+      for_each_playing([&](Instrument &instrument) {
+         float level = instrument.quietest_level();
+         if (level >= 0.0f && (!quietest || level < quietest_level))
+         {
+            quietest = &instrument;
+            quietest_level = level;
+         }
+      });
+
+      if (!quietest)
+         break;
+      quietest->shed_quietest();
+      shed++;
+   }
+
+   return shed;
+}
+
+void AirSynth::enable_governor(bool enable)
+{
+   governor_enabled = enable;
+   configure_governor();
+   set_lod_threshold(lod_db);
+}
+
+void AirSynth::update_program_buses()
+{
+   program_buses = 0;
+   for (unsigned program = 0; program < num_programs; program++)
+   {
+      program_bus[program] = program_buses;
+      if (has_program(program))
+         program_buses++;
+   }
+}
+
+unsigned AirSynth::buses() const
+{
+   switch (routing)
+   {
+      case Routing::Channel:
+         return num_midi_channels;
+      case Routing::Program:
+         return max(program_buses, 1u);
+      default:
+         return 1;
+   }
+}
+
+string AirSynth::bus_name(unsigned bus) const
+{
+   switch (routing)
+   {
+      case Routing::Channel:
+         return "ch" + to_string(bus + 1);
+
+      case Routing::Program:
+         for (unsigned program = 0; program < num_programs; program++)
+            if (has_program(program) && program_bus[program] == bus)
+               return "program" + to_string(program);
+         return "";
+
+      default:
+         return "";
+   }
+}
+
+void AirSynth::render_part_job(void *data, unsigned job)
+{
+   auto &self = *static_cast<AirSynth*>(data);
+   float **out = self.job_outputs.data() + job * self.part_channels;
+   MixTarget target(out, self.job_amp, self.channels, MixTarget::Mode::Overwrite);
+   self.rendering[job].instrument->render(target, self.job_frames, false);
+}
+
+void AirSynth::render_parts(float **buffer, const float *amp, unsigned frames, bool routed)
+{
+   unsigned num_buses = routed ? buses() : 1;
+   fill(bus_used, bus_used + num_buses, false);
+
+   rendering.clear();
+   auto add = [&](Instrument &instrument, unsigned channel, unsigned program) {
+      if (instrument.idle())
+         return;
+
+      unsigned bus = 0;
+      if (routed && routing == Routing::Channel)
+         bus = channel;
+      else if (routed && routing == Routing::Program)
+         bus = program_bus[program];
+
+      rendering.push_back({&instrument, bus, !bus_used[bus]});
+      bus_used[bus] = true;
+   };
+
+   for (unsigned channel = 0; channel < num_midi_channels; channel++)
+   {
+      auto &part = parts[channel];
+      Instrument *instrument = part.instrument.load(memory_order_relaxed);
+      if (instrument)
+         add(*instrument, channel, part.program.load(memory_order_relaxed));
+   }
+   for (auto &drain : draining)
+      add(*drain.instrument, drain.channel, drain.program);
+
+   // A single part can still spread its voices over the workers.
+   // Without workers, parts are mixed the same way on this thread, so output
+   // does not depend on the number of threads.
+   if (rendering.size() <= 1 || channels > part_channels)
+   {
+      for (auto &job : rendering)
+      {
+         MixTarget target(buffer + job.bus * channels, amp, channels,
+               job.direct ? MixTarget::Mode::Overwrite : MixTarget::Mode::Accumulate);
+         job.instrument->render(target, frames);
+      }
+   }
+   else
+   {
+      job_amp = amp;
+      unsigned jobs = rendering.size();
+
+      for (unsigned offset = 0; offset < frames; offset += Instrument::max_job_frames)
+      {
+         job_frames = min(unsigned(Instrument::max_job_frames), frames - offset);
+
+         // The first part on a bus renders straight into it, the others to scratch buffers.
+         for (unsigned job = 0; job < jobs; job++)
+         {
+            float **out = job_outputs.data() + job * part_channels;
+            float **bus = buffer + rendering[job].bus * channels;
+            for (unsigned c = 0; c < channels; c++)
+            {
+               out[c] = rendering[job].direct ?
+                  bus[c] + offset : part_outputs[job * part_channels + c];
+            }
+         }
+
+         if (workers)
+            workers->run(render_part_job, this, jobs);
+         else
+         {
+            for (unsigned job = 0; job < jobs; job++)
+               render_part_job(this, job);
+         }
+
+         // Always sum in part order, regardless of which thread rendered what.
+         for (unsigned job = 0; job < jobs; job++)
+         {
+            if (rendering[job].direct)
+               continue;
+
+            float **src = part_outputs.data() + job * part_channels;
+            float **bus = buffer + rendering[job].bus * channels;
+            for (unsigned c = 0; c < channels; c++)
+            {
+               float *dst = bus[c] + offset;
+               for (unsigned i = 0; i < job_frames; i++)
+                  dst[i] += src[c][i];
+            }
+         }
+      }
+   }
+
+   // Nothing else writes buses which no part plays on.
+   for (unsigned bus = 0; bus < num_buses; bus++)
+   {
+      if (!bus_used[bus])
+         for (unsigned c = 0; c < channels; c++)
+            fill(buffer[bus * channels + c], buffer[bus * channels + c] + frames, 0.0f);
+   }
 }
 
-void AirSynth::set_sustain(bool sustain)
+bool AirSynth::idle() const
 {
-   instrument.set_sustain(sustain);
+   bool idle = true;
+   for_each_playing([&idle](Instrument &instrument) {
+      idle = idle && instrument.idle();
+   });
+   return idle;
 }
 
 void AirSynth::process_audio(float **buffer, const float *amp, unsigned frames)
 {
-   instrument.render(buffer, amp, frames, channels);
+   render(buffer, amp, frames, false);
+}
+
+void AirSynth::process_buses(float **buffer, const float *amp, unsigned frames)
+{
+   render(buffer, amp, frames, true);
+}
+
+void AirSynth::render(float **buffer, const float *amp, unsigned frames, bool routed)
+{
+   if (!governor_enabled)
+   {
+      render_parts(buffer, amp, frames, routed);
+      recycle_drained();
+      return;
+   }
+
+   governor.begin();
+   render_parts(buffer, amp, frames, routed);
+   recycle_drained();
+   unsigned limit = governor.end(frames, sounding());
+   if (limit != voice_limit)
+      governor.add_shed(set_voice_limit(limit));
+   update_lod_pressure();
 }
 
 void Instrument::set_note(unsigned note,
-      unsigned velocity, unsigned sample_rate)
+      unsigned velocity, unsigned sample_rate, unsigned frame)
 {
+   if (!pool)
+      return;
+
+   auto &voices = *pool;
    if (velocity == 0)
    {
-      for (auto &tone : voices)
-         if (note == tone->get_note())
-            tone->release(sustain);
+      allocator.for_each_note(note, [&](unsigned index) {
+         auto &tone = voices[index];
+         tone.release(sustain, frame);
+         if (tone.is_releasing())
+            allocator.release(index);
+         else if (tone.is_sustained())
+            allocator.sustain(index);
+      });
    }
    else
    {
-      auto itr = find_if(begin(voices), end(voices),
-            [](const unique_ptr<Voice> &t) { return !t->active(); });
-      if (itr == end(voices))
-         return;
-      (*itr)->trigger(note, velocity, sample_rate);
+      if (allocator.sounding() >= voice_limit)
+      {
+         unsigned victim = allocator.select_victim(note);
+         if (victim != VoiceAllocator::invalid)
+         {
+            voices[victim].kill(steal_fade, frame);
+            allocator.fade(victim);
+         }
+      }
+
+      unsigned index = allocator.pop_free();
+      if (index == VoiceAllocator::invalid)
+      {
+         // Every spare voice is still fading out, cut the oldest one short.
+         index = allocator.oldest_fading();
+         if (index == VoiceAllocator::invalid)
+            return;
+         allocator.retire(index);
+         index = allocator.pop_free();
+      }
+
+      // A voice cut short is still in the active list.
+      bool listed = voices[index].active();
+      voices.trigger(index, note, velocity, sample_rate);
+
+      if (voices[index].active())
+      {
+         voices[index].delay_start(frame);
+         PitchCurve pitch;
+         pitch.ratio = modulation.ratio();
+         voices[index].set_pitch(pitch);
+         allocator.triggered(index, note);
+         if (!listed)
+            active_voices.push_back(index);
+      }
+      else if (!listed)
+         allocator.retire(index);
    }
 }
 
-void Instrument::set_sustain(bool sustain)
+void Instrument::set_sustain(bool sustain, unsigned frame)
 {
    this->sustain = sustain;
-   if (sustain)
+   if (sustain || !pool)
+      return;
+
+   auto &voices = *pool;
+   allocator.for_each_sustained([&](unsigned index) {
+      voices[index].release_sustain(frame);
+      allocator.release(index);
+   });
+}
+
+unique_ptr<VoicePoolBase> Instrument::create_voices(unsigned num_voices) const
+{
+   if (!pool || !pool->size())
+      return {};
+
+   auto voices = pool->create(num_voices);
+   auto &env = (*pool)[0].get_envelope();
+   for (unsigned i = 0; i < voices->size(); i++)
+   {
+      (*voices)[i].set_envelope(env);
+      (*voices)[i].set_silence_level(env.silence);
+   }
+   return voices;
+}
+
+void Instrument::release_all(unsigned frame)
+{
+   set_sustain(false, frame);
+   for (unsigned note = 0; note < 128; note++)
+      set_note(note, 0, 0, frame);
+}
+
+void Instrument::prewarm(unsigned sample_rate)
+{
+   if (!pool)
       return;
 
-   for (auto &tone : voices)
-      tone->release_sustain();
+   vector<float> scratch(Voice::max_channels * max_job_frames);
+   float *out[Voice::max_channels];
+   float amp[Voice::max_channels];
+   for (unsigned c = 0; c < Voice::max_channels; c++)
+   {
+      out[c] = scratch.data() + c * max_job_frames;
+      amp[c] = 1.0f;
+   }
+
+   for (unsigned i = 0; i < polyphony; i++)
+      set_note(24 + i % 96, 100, sample_rate);
+   render(MixTarget(out, amp, 2, MixTarget::Mode::Overwrite), max_job_frames, false);
+   reset();
+}
+
+void Instrument::set_pitch_bend(unsigned value, unsigned frame)
+{
+   queue_control({ControlEvent::Type::PitchBend, 0, uint16_t(value), frame});
+}
+
+void Instrument::set_pressure(unsigned value, unsigned frame)
+{
+   queue_control({ControlEvent::Type::Pressure, 0, uint16_t(value), frame});
 }
 
-void Instrument::render(float **mix_buffer, const float *amp, unsigned frames, unsigned channels)
+void Instrument::set_control(unsigned controller, unsigned value, unsigned frame)
 {
-   for (auto &tone : voices)
-      if (tone->active())
-         tone->render(mix_buffer, amp, frames, channels);
+   queue_control({ControlEvent::Type::Control, uint8_t(controller), uint16_t(value), frame});
+}
+
+void Instrument::queue_control(const ControlEvent &event)
+{
+   // Never grow the queue on the audio thread. A flood of controller data
+   // only loses its timing within the block.
+   if (control_events.size() < control_events.capacity())
+      control_events.push_back(event);
+   else
+      apply_control(event);
+}
+
+void Instrument::apply_control(const ControlEvent &event)
+{
+   switch (event.type)
+   {
+      case ControlEvent::Type::PitchBend:
+         modulation.set_pitch_bend(event.value);
+         break;
+      case ControlEvent::Type::Pressure:
+         modulation.set_pressure(event.value);
+         break;
+      case ControlEvent::Type::Control:
+         modulation.set_control(event.controller, event.value);
+         break;
+   }
+}
+
+void Instrument::inherit_modulation(const Instrument &instrument)
+{
+   modulation = instrument.modulation;
+   control_events.clear();
+   for (auto &event : instrument.control_events)
+      queue_control(event);
+}
+
+void Instrument::set_steal_policy(const StealPolicy &policy)
+{
+   allocator.set_policy(policy);
+}
+
+unsigned Instrument::set_voice_limit(unsigned limit)
+{
+   voice_limit = max(min(limit, polyphony), 1u);
+   if (!pool)
+      return 0;
+
+   unsigned shed = 0;
+   while (allocator.sounding() > voice_limit)
+   {
+      shed_quietest();
+      shed++;
+   }
+   return shed;
+}
+
+float Instrument::quietest_level()
+{
+   if (!pool || !allocator.sounding())
+      return -1.0f;
+   return (*pool)[allocator.select_quietest()].amplitude();
+}
+
+void Instrument::shed_quietest()
+{
+   if (!pool || !allocator.sounding())
+      return;
+
+   unsigned victim = allocator.select_quietest();
+   (*pool)[victim].kill(steal_fade);
+   allocator.fade(victim);
+}
+
+void Instrument::set_envelope(float gain, float attack, float delay, float sustain_level, float release)
+{
+   if (!pool)
+      return;
+
+   for (unsigned i = 0; i < pool->size(); i++)
+      (*pool)[i].set_envelope(gain, attack, delay, sustain_level, release);
+}
+
+void Instrument::set_lod_threshold(float db)
+{
+   lod_level = pow(10.0f, db / 20.0f);
+}
+
+void Instrument::set_silence_threshold(float db)
+{
+   if (!pool)
+      return;
+
+   for (unsigned i = 0; i < pool->size(); i++)
+      (*pool)[i].set_silence_threshold(db);
+}
+
+void Instrument::set_worker_pool(WorkerPool *workers, unsigned channels)
+{
+   this->workers = workers;
+   mix_channels = channels;
+   allocate_mix_buffers();
+}
+
+void Instrument::allocate_mix_buffers()
+{
+   unsigned jobs = pool ? (pool->size() + voices_per_job - 1) / voices_per_job : 0;
+   mix_buffers.resize(jobs * mix_channels * max_job_frames);
+   job_outputs.resize(jobs * mix_channels);
+   for (unsigned i = 0; i < job_outputs.size(); i++)
+      job_outputs[i] = mix_buffers.data() + i * max_job_frames;
+}
+
+void Instrument::render_job(void *data, unsigned job)
+{
+   auto &self = *static_cast<Instrument*>(data);
+   float **out = self.job_outputs.data() + job * self.mix_channels;
+   MixTarget target(out, self.job_amp, self.job_channels, MixTarget::Mode::Overwrite);
+
+   unsigned first = job * voices_per_job;
+   unsigned count = min(unsigned(voices_per_job), unsigned(self.active_voices.size()) - first);
+   self.pool->render(self.active_voices.data() + first, count, target, self.job_frames);
+}
+
+void Instrument::render_groups(const MixTarget &target, unsigned frames, bool parallel)
+{
+   unsigned jobs = (active_voices.size() + voices_per_job - 1) / voices_per_job;
+   unsigned channels = target.channels;
+   job_amp = target.amp;
+   job_channels = channels;
+   bool overwrite = target.mode == MixTarget::Mode::Overwrite;
+
+   for (unsigned offset = 0; offset < frames; offset += max_job_frames)
+   {
+      job_frames = min(unsigned(max_job_frames), frames - offset);
+      if (parallel)
+         workers->run(render_job, this, jobs);
+      else
+      {
+         for (unsigned job = 0; job < jobs; job++)
+            render_job(this, job);
+      }
+
+      // Always sum in job order, regardless of which thread rendered what.
+      for (unsigned job = 0; job < jobs; job++)
+      {
+         float **src = job_outputs.data() + job * mix_channels;
+         for (unsigned c = 0; c < channels; c++)
+         {
+            float *dst = target.out[c] + offset;
+            if (overwrite && job == 0)
+               copy(src[c], src[c] + job_frames, dst);
+            else
+            {
+               for (unsigned i = 0; i < job_frames; i++)
+                  dst[i] += src[c][i];
+            }
+         }
+      }
+   }
+}
+
+void Instrument::render(const MixTarget &target, unsigned frames, bool use_workers)
+{
+   if (!modulation.active() && control_events.empty())
+   {
+      render_block(target, frames, use_workers);
+      return;
+   }
+
+   // Evaluate modulation once per control period, up front for a whole chunk.
+   // Voices glide through the resulting curve, so they never have to convert
+   // pitch themselves, and the chunk renders in one go.
+   float *chunk_out[Voice::max_channels];
+   MixTarget chunk = target;
+   chunk.out = chunk_out;
+
+   unsigned event = 0;
+   for (unsigned offset = 0; offset < frames; offset += max_job_frames)
+   {
+      PitchCurve curve;
+      curve.points = pitch_points;
+      curve.period = Modulator::control_frames;
+      curve.frames = min(unsigned(max_job_frames), frames - offset);
+
+      for (unsigned pos = 0; pos < curve.frames; pos += curve.period)
+      {
+         while (event < control_events.size() && control_events[event].frame <= offset + pos)
+            apply_control(control_events[event++]);
+
+         unsigned len = min(curve.period, curve.frames - pos);
+         pitch_points[curve.count++] = modulation.advance(len, sample_rate);
+      }
+
+      for (auto index : active_voices)
+         (*pool)[index].set_pitch(curve);
+
+      for (unsigned c = 0; c < target.channels; c++)
+         chunk_out[c] = target.out[c] + offset;
+      render_block(chunk, curve.frames, use_workers);
+   }
+
+   while (event < control_events.size() && control_events[event].frame < frames)
+      apply_control(control_events[event++]);
+
+   // Blocks may be rendered in chunks, keep events of later chunks for them.
+   unsigned kept = 0;
+   for (; event < control_events.size(); event++)
+   {
+      auto pending = control_events[event];
+      pending.frame -= frames;
+      control_events[kept++] = pending;
+   }
+   control_events.resize(kept);
+}
+
+void Instrument::render_block(const MixTarget &target, unsigned frames, bool use_workers)
+{
+   if (active_voices.empty())
+   {
+      target.clear(0, frames);
+      return;
+   }
+
+   // Voices are mixed in the same groups with or without workers, so output
+   // does not depend on the number of threads.
+   if (target.channels <= mix_channels)
+      render_groups(target, frames, use_workers && workers);
+   else
+   {
+      // Before audio is configured, e.g. when prewarming.
+      // Voices never see more than Voice::max_frames, whatever the block size of the driver.
+      float *chunk_out[Voice::max_channels];
+      MixTarget chunk = target;
+      chunk.out = chunk_out;
+      for (unsigned offset = 0; offset < frames; offset += Voice::max_frames)
+      {
+         for (unsigned c = 0; c < target.channels; c++)
+            chunk_out[c] = target.out[c] + offset;
+         pool->render(active_voices.data(), active_voices.size(), chunk,
+               min(unsigned(Voice::max_frames), frames - offset));
+      }
+   }
+
+   // Retired voices drop out of the list, keeping trigger order intact.
+   auto &voices = *pool;
+   unsigned kept = 0;
+   for (auto index : active_voices)
+   {
+      auto &tone = voices[index];
+      if (tone.active())
+      {
+         float level = tone.amplitude();
+         allocator.update_level(index, level);
+         update_quality(tone, level);
+         active_voices[kept++] = index;
+      }
+      else
+         allocator.retire(index);
+   }
+   active_voices.resize(kept);
 }
 
 void Instrument::reset()
 {
    sustain = false;
-   for (auto &tone : voices)
-      tone->active(false);
+   modulation.reset();
+   control_events.clear();
+   if (pool)
+   {
+      for (unsigned i = 0; i < pool->size(); i++)
+         (*pool)[i].active(false);
+   }
+   active_voices.clear();
+   allocator.reset();
+}
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash)
+{
+   auto bytes = static_cast<const uint8_t*>(data);
+   for (size_t i = 0; i < size; i++)
+   {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ull;
+   }
+   return hash;
 }
 
 void Voice::trigger(unsigned note, unsigned vel, unsigned sample_rate, float)
@@ -120,12 +1012,22 @@ void Voice::trigger(unsigned note, unsigned vel, unsigned sample_rate, float)
    env.time_step = time_step;
 
    time = 0.0;
+   env.fade = 0.0f;
+   m_quality = Quality::Full;
+   start_delay = 0;
+   release_pending = false;
+   pending_fade = 0.0f;
    active(vel != 0);
 }
 
 bool Voice::check_release_complete()
 {
-   if (released && time >= released_time + env.release)
+   if (!released)
+      return false;
+
+   // The exponential release is inaudible long before env.release has passed.
+   if (time >= released_time + env.release_length() ||
+         amplitude() < env.silence)
    {
       sustained = false;
       released = false;
@@ -150,11 +1052,17 @@ Filter::Filter()
    : Filter({}, {})
 {}
 
+uint64_t Filter::hash(uint64_t hash) const
+{
+   hash = hash_bytes(b.data(), b.size() * sizeof(float), hash);
+   return hash_bytes(a.data(), a.size() * sizeof(float), hash);
+}
+
 void Filter::reset()
 {
-   buffer.clear();
-   auto len = max(a.size(), b.size()) - 1;
-   buffer.resize(len);
+   len = max(a.size(), b.size());
+   buffer.assign(2 * len, 0.0f);
+   ptr = 0;
 }
 
 #ifndef M_PI
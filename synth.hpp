@@ -18,11 +18,23 @@
 #define AIRSYNTH_HPP__
 
 #include <memory>
+#include <atomic>
 #include <cstdint>
 #include <vector>
-#include <deque>
 #include <random>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <functional>
+#include <typeinfo>
 #include "audio_driver.hpp"
+#include "denormal.hpp"
+#include "aligned.hpp"
+#include "worker_pool.hpp"
+#include "governor.hpp"
+#include "mix.hpp"
+#include "modulation.hpp"
 
 #include "blipper.h"
 
@@ -37,14 +49,31 @@ class Synthesizer : public AudioCallback
 
       void process_midi(MidiEvent event) override;
 
-      virtual void set_note(unsigned note, unsigned velocity) = 0;
-      virtual void set_sustain(bool enable) = 0;
+      enum { num_midi_channels = 16 };
+
+      // frame is the offset into the next block where the event takes effect.
+      virtual void set_note(unsigned channel, unsigned note, unsigned velocity, unsigned frame = 0) = 0;
+      virtual void set_sustain(unsigned channel, bool enable, unsigned frame = 0) = 0;
+      virtual void set_program(unsigned channel, unsigned program, unsigned frame = 0) = 0;
+      virtual void set_pitch_bend(unsigned channel, unsigned value, unsigned frame = 0) = 0;
+      virtual void set_pressure(unsigned channel, unsigned value, unsigned frame = 0) = 0;
+      virtual void set_control(unsigned channel, unsigned controller, unsigned value, unsigned frame = 0) = 0;
+
+      // Rounds event offsets down to a multiple of frames. 1 is sample accurate.
+      inline void set_event_grid(unsigned frames)
+      {
+         event_grid = frames ? frames : 1;
+      }
 
       virtual ~Synthesizer() = default;
 
    protected:
       unsigned channels = 2;
       unsigned sample_rate = 44100;
+      unsigned event_grid = 1;
+
+      // Repeated pedal events which do not change its state are dropped.
+      bool sustain_pedal[num_midi_channels] = {};
 };
 
 struct Envelope
@@ -56,14 +85,26 @@ struct Envelope
    float amp = 0.0;
    float gain = 1.0;
 
+   // Released voices are retired once their output level drops below this.
+   float silence = 0.0000158f; // -96 dB
+
+   // When non-zero, overrides release. Used to quickly fade out stolen voices.
+   float fade = 0.0f;
+
    float time_step = 1.0 / 44100.0;
 
+   inline float release_length() const
+   {
+      return fade > 0.0f ? fade : release;
+   }
+
    inline float envelope(float time, bool released)
    {
       if (released)
       {
-         float release_factor = 8.0f * time_step / release;
+         float release_factor = 8.0f * time_step / release_length();
          amp -= amp * release_factor;
+         flush_denormal(amp, denormals);
       }
       else if (time >= attack + delay)
          amp = sustain_level;
@@ -77,12 +118,54 @@ struct Envelope
 
       return gain * amp;
    }
+
+   static DenormalCounter denormals;
 };
 
+// FNV-1a over size bytes, continuing from hash.
+uint64_t hash_bytes(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
 struct Voice
 {
    public:
-      virtual unsigned render(float **out, const float *amp, unsigned frames, unsigned channels) = 0;
+      // Returns the number of frames rendered, fewer if the voice finished.
+      virtual unsigned render(const MixTarget &target, unsigned frames) = 0;
+
+      // Instruments split longer blocks, so voices size their buffers from this
+      // rather than from the block size of the driver.
+      enum { max_channels = 8, max_frames = 1024 };
+
+      // Events can take effect part-way into the next render() call.
+      // Offsets are in frames from the start of that call.
+      inline void delay_start(unsigned frames)
+      {
+         start_delay = frames;
+      }
+
+      inline bool has_timed_events() const
+      {
+         return start_delay || release_pending;
+      }
+
+      // Renders voice, splitting the block only at its own pending events.
+      // Frames the voice does not cover are cleared if the target is overwritten.
+      template<typename T>
+      static void render_timed(T &voice, const MixTarget &target, unsigned frames);
+
+      // Restarts any random source of the voice, so the next note renders the same
+      // every time. Voices without one ignore this.
+      virtual void seed(uint32_t) {}
+
+      // Fingerprint of what the output depends on besides the envelope and the arguments
+      // of trigger(), such as filter coefficients, so rendered notes can be cached across
+      // runs. Changes to how voices render still need NoteCache::version to be bumped.
+      virtual uint64_t parameter_hash() const { return 0; }
+
+      // Glides through the ratios of curve over the next frames, see PitchCurve.
+      // Voices which cannot bend ignore this.
+      virtual void set_pitch(const PitchCurve &) {}
+      // Moves frames along the pitch curve without rendering, while the voice waits to start.
+      virtual void skip_pitch(unsigned) {}
 
       // Sub-classes of Voice should call this if overridden.
       virtual void trigger(unsigned note, unsigned velocity, unsigned sample_rate, float detune = 0.0f);
@@ -101,9 +184,27 @@ struct Voice
          env.release = release;
       }
 
+      // The silence threshold is kept, it is only changed by set_silence_threshold().
       virtual inline void set_envelope(const Envelope &env)
       {
+         float silence = this->env.silence;
          this->env = env;
+         this->env.silence = silence;
+      }
+
+      inline const Envelope &get_envelope() const
+      {
+         return env;
+      }
+
+      inline void set_silence_threshold(float db)
+      {
+         set_silence_level(std::pow(10.0f, db / 20.0f));
+      }
+
+      inline void set_silence_level(float level)
+      {
+         env.silence = level;
       }
 
       inline unsigned get_note() const
@@ -111,29 +212,78 @@ struct Voice
          return note;
       }
 
+      inline bool is_released() const
+      {
+         return released;
+      }
+
+      inline bool is_sustained() const
+      {
+         return sustained;
+      }
+
+      // True if released, or if a release is pending later in the block.
+      inline bool is_releasing() const
+      {
+         return released || release_pending;
+      }
+
+      // Current output level of the envelope, including velocity.
+      inline float amplitude() const
+      {
+         return m_velocity * env.gain * env.amp;
+      }
+
+      // Quiet voices can be rendered with cheaper filters, where the loss
+      // in quality is masked by louder voices. Voices must be able to switch
+      // between tiers at any block boundary without clicking.
+      enum class Quality : uint8_t { Full, Reduced };
+
+      inline void set_quality(Quality quality)
+      {
+         m_quality = quality;
+      }
+
+      inline Quality quality() const
+      {
+         return m_quality;
+      }
+
+      inline bool in_attack() const
+      {
+         return !released && time < env.attack + env.delay;
+      }
+
+      // Fades out over fade_time seconds, regardless of sustain.
+      inline void kill(float fade_time, unsigned frame = 0)
+      {
+         if (active())
+         {
+            sustained = false;
+            pending_fade = fade_time;
+            begin_release(frame);
+         }
+      }
+
       // Should always be called when sustain is released.
-      inline void release_sustain()
+      inline void release_sustain(unsigned frame = 0)
       {
          if (active() && sustained)
          {
-            released = true;
-            released_time = time;
             sustained = false;
+            begin_release(frame);
          }
       }
 
       // If sustained, the release will be deferred until release_sustain() is called.
-      inline void release(bool sustained)
+      inline void release(bool sustained, unsigned frame = 0)
       {
          if (active() && !this->sustained && !released)
          {
             if (sustained)
                this->sustained = true;
             else
-            {
-               released = true;
-               released_time = time;
-            }
+               begin_release(frame);
          }
       }
 
@@ -157,32 +307,496 @@ struct Voice
       float m_velocity = 0.0f;
 
       bool m_active = false;
+      Quality m_quality = Quality::Full;
+
+      unsigned start_delay = 0;
+      unsigned release_frame = 0;
+      bool release_pending = false;
+      float pending_fade = 0.0f;
+
+      inline void begin_release(unsigned frame)
+      {
+         if (frame)
+         {
+            if (!release_pending || frame < release_frame)
+               release_frame = frame;
+            release_pending = true;
+         }
+         else
+            apply_release();
+      }
+
+      inline void apply_release()
+      {
+         release_pending = false;
+         if (pending_fade > 0.0f)
+         {
+            // Killing restarts the release, even if already released.
+            env.fade = pending_fade;
+            pending_fade = 0.0f;
+            released = false;
+         }
+
+         if (!released)
+         {
+            released = true;
+            released_time = time;
+         }
+      }
+};
+
+template<typename T>
+void Voice::render_timed(T &voice, const MixTarget &target, unsigned frames)
+{
+   Voice &v = voice;
+   float *shifted_out[max_channels];
+   MixTarget shifted = target;
+   shifted.out = shifted_out;
+
+   unsigned pos = std::min(v.start_delay, frames);
+   v.start_delay -= pos;
+   target.clear(0, pos);
+   if (pos)
+      voice.T::skip_pitch(pos);
+
+   while (pos < frames && v.active())
+   {
+      if (v.release_pending && v.release_frame <= pos)
+         v.apply_release();
+
+      unsigned end = v.release_pending ? std::min(v.release_frame, frames) : frames;
+      for (unsigned c = 0; c < target.channels; c++)
+         shifted_out[c] = target.out[c] + pos;
+
+      unsigned rendered = voice.T::render(shifted, end - pos);
+      pos += rendered;
+      if (pos < end)
+         break;
+   }
+   target.clear(pos, frames - pos);
+
+   if (v.release_pending)
+      v.release_frame = v.release_frame > frames ? v.release_frame - frames : 0;
+}
+
+// Type-erased view of a pool of voices which all share one concrete type.
+// The Voice part of any voice is reachable without virtual calls.
+class VoicePoolBase
+{
+   public:
+      virtual ~VoicePoolBase() = default;
+
+      inline unsigned size() const { return count; }
+      inline Voice &operator[](unsigned index)
+      {
+         return *reinterpret_cast<Voice*>(base + index * stride);
+      }
+
+      // Called once per block, voices are rendered in a non-virtual loop.
+      // If target is overwritten, the first voice overwrites and the rest accumulate.
+      virtual void render(const unsigned *indices, unsigned num_indices,
+            const MixTarget &target, unsigned frames) = 0;
+      virtual void trigger(unsigned index, unsigned note, unsigned velocity,
+            unsigned sample_rate, float detune = 0.0f) = 0;
+
+      virtual const char *voice_type() const = 0;
+
+      // New pool of the same voice type, constructed with the same parameters.
+      inline std::unique_ptr<VoicePoolBase> create(unsigned num_voices) const
+      {
+         return std::unique_ptr<VoicePoolBase>(factory(num_voices));
+      }
+
+   protected:
+      uint8_t *base = nullptr;
+      size_t stride = 0;
+      unsigned count = 0;
+      std::function<VoicePoolBase *(unsigned)> factory;
+};
+
+// Stores all voices back-to-back in one arena, each voice starting on its own cache line.
+template<typename T>
+class VoicePool : public VoicePoolBase
+{
+   public:
+      template<typename... P>
+      VoicePool(unsigned num_voices, const P&... p)
+      {
+         voice_stride = (sizeof(T) + alignment - 1) & ~(alignment - 1);
+
+         void *ptr = nullptr;
+         if (posix_memalign(&ptr, alignment, num_voices * voice_stride) != 0)
+            throw std::bad_alloc();
+         arena = static_cast<uint8_t*>(ptr);
+
+         try
+         {
+            for (count = 0; count < num_voices; count++)
+               new (arena + count * voice_stride) T(p...);
+         }
+         catch (...)
+         {
+            destroy();
+            throw;
+         }
+
+         base = arena;
+         if (count)
+            base = reinterpret_cast<uint8_t*>(static_cast<Voice*>(&voice(0)));
+         stride = voice_stride;
+
+         factory = [p...](unsigned num_voices) -> VoicePoolBase* {
+            return new VoicePool<T>(num_voices, p...);
+         };
+      }
+
+      ~VoicePool()
+      {
+         destroy();
+      }
+
+      VoicePool(VoicePool&&) = delete;
+      void operator=(VoicePool&&) = delete;
+
+      inline T &voice(unsigned index)
+      {
+         return *reinterpret_cast<T*>(arena + index * voice_stride);
+      }
+
+      void render(const unsigned *indices, unsigned num_indices,
+            const MixTarget &target, unsigned frames) override
+      {
+         MixTarget mix = target;
+         for (unsigned i = 0; i < num_indices; i++)
+         {
+            auto &v = voice(indices[i]);
+            if (!v.active())
+               continue;
+
+            if (v.has_timed_events())
+               Voice::render_timed(v, mix, frames);
+            else
+            {
+               unsigned rendered = v.T::render(mix, frames);
+               mix.clear(rendered, frames - rendered);
+            }
+            mix.mode = MixTarget::Mode::Accumulate;
+         }
+         mix.clear(0, frames);
+      }
+
+      void trigger(unsigned index, unsigned note, unsigned velocity,
+            unsigned sample_rate, float detune) override
+      {
+         voice(index).T::trigger(note, velocity, sample_rate, detune);
+      }
+
+      const char *voice_type() const override
+      {
+         return typeid(T).name();
+      }
+
+   private:
+      enum { alignment = 64 };
+      uint8_t *arena = nullptr;
+      size_t voice_stride = 0;
+
+      void destroy()
+      {
+         for (unsigned i = 0; i < count; i++)
+            voice(i).~T();
+         free(arena);
+         arena = nullptr;
+         count = 0;
+      }
+};
+
+struct StealPolicy
+{
+   enum class Order
+   {
+      Oldest,
+      Quietest
+   };
+
+   Order order = Order::Oldest;
+   // Prefer stealing a voice which already plays the same note.
+   bool same_note_first = true;
+   // Prefer stealing voices in their release phase over held ones.
+   bool released_first = true;
+};
+
+// Doubly linked list threaded through an array of links, indexed by voice.
+class IndexList
+{
+   public:
+      enum : unsigned { invalid = ~0u };
+
+      struct Link
+      {
+         unsigned prev = invalid;
+         unsigned next = invalid;
+      };
+
+      inline unsigned front() const { return head; }
+      inline bool empty() const { return head == invalid; }
+      inline unsigned size() const { return count; }
+
+      void push_back(Link *links, unsigned index);
+      void remove(Link *links, unsigned index);
+      inline void clear() { head = tail = invalid; count = 0; }
+
+      // func may remove the index it is called with from the list.
+      template<typename Func>
+      inline void for_each(const Link *links, const Func &func) const
+      {
+         for (unsigned index = head; index != invalid; )
+         {
+            unsigned next = links[index].next;
+            func(index);
+            index = next;
+         }
+      }
+
+   private:
+      unsigned head = invalid;
+      unsigned tail = invalid;
+      unsigned count = 0;
+};
+
+// Keeps track of voice states for an Instrument and picks voices to steal.
+// All operations are O(1).
+class VoiceAllocator
+{
+   public:
+      enum : unsigned { invalid = IndexList::invalid };
+
+      // Level buckets are 6 dB wide, spanning down to -96 dB.
+      enum { num_levels = 16 };
+
+      void init(unsigned num_voices);
+      void reset();
+
+      inline void set_policy(const StealPolicy &policy) { this->policy = policy; }
+
+      // Voices which are held or releasing, i.e. not idle or fading out after a steal.
+      inline unsigned sounding() const { return held.size() + released.size(); }
+
+      // Returns invalid if there is no free voice.
+      unsigned pop_free();
+      unsigned select_victim(unsigned note) const;
+      // Least audible sounding voice, released voices first within a level.
+      unsigned select_quietest() const { return quietest(); }
+      unsigned oldest_fading() const { return fading.front(); }
+
+      void triggered(unsigned index, unsigned note);
+      void sustain(unsigned index);
+      void release(unsigned index);
+      void fade(unsigned index);
+      void retire(unsigned index);
+      void update_level(unsigned index, float amplitude);
+
+      // Visits held and released voices playing note, oldest first.
+      template<typename Func>
+      inline void for_each_note(unsigned note, const Func &func) const
+      {
+         notes[note & 127].for_each(note_links.data(), func);
+      }
+
+      // Visits voices whose release is deferred by the sustain pedal.
+      template<typename Func>
+      inline void for_each_sustained(const Func &func) const
+      {
+         sustained.for_each(sustain_links.data(), func);
+      }
+
+   private:
+      enum class State : uint8_t
+      {
+         Free,
+         Reserved,
+         Held,
+         Released,
+         Fading
+      };
+
+      struct Slot
+      {
+         State state = State::Free;
+         uint8_t level = 0;
+         uint8_t note = 0;
+         bool sustained = false;
+         uint64_t age = 0;
+      };
+
+      StealPolicy policy;
+      std::vector<Slot> slots;
+      std::vector<unsigned> free_list;
+
+      // A voice is in one age list at a time, ordered oldest first.
+      std::vector<IndexList::Link> age_links;
+      IndexList held, released, fading;
+
+      std::vector<IndexList::Link> level_links;
+      IndexList held_levels[num_levels];
+      IndexList released_levels[num_levels];
+
+      std::vector<IndexList::Link> note_links;
+      IndexList notes[128];
+
+      std::vector<IndexList::Link> sustain_links;
+      IndexList sustained;
+
+      uint64_t age_counter = 0;
+
+      void unlink(unsigned index);
+      unsigned quietest(const IndexList *levels) const;
+      unsigned quietest() const;
+      unsigned oldest() const;
 };
 
 // Uses voice-stealing algorithm to implement a multiple-voice instrument.
 class Instrument
 {
    public:
+      // Length of the fade-out applied to a stolen voice.
+      static constexpr float steal_fade = 0.005f;
+
+      // Voices are rendered in parallel in groups of voices_per_job,
+      // max_job_frames at a time.
+      enum { voices_per_job = 4, max_job_frames = Voice::max_frames };
+
       template<typename T, typename... P>
       inline void init(unsigned num_voices, const P&... p)
       {
-         voices.clear();
-         for (unsigned i = 0; i < num_voices; i++)
-            voices.push_back(std::unique_ptr<Voice>(new T(p...)));
+         // Extra voices let stolen voices fade out while the new note starts.
+         unsigned headroom = std::max(2u, num_voices / 8);
+
+         active_voices.clear();
+         pool.reset(new VoicePool<T>(num_voices + headroom, p...));
+         active_voices.reserve(num_voices + headroom);
+         allocator.init(num_voices + headroom);
+         control_events.reserve(max_control_events);
+         polyphony = num_voices;
+         voice_limit = num_voices;
+         allocate_mix_buffers();
       }
 
-      void render(float **buffer, const float *amp, unsigned frames, unsigned channels);
+      // Target channels must not exceed Voice::max_channels.
+      // With use_workers false, voices are rendered on the calling thread only.
+      // Controller changes timed past frames are kept for the next call, so a block
+      // may be rendered in several calls.
+      void render(const MixTarget &target, unsigned frames, bool use_workers = true);
       void set_note(unsigned note,
-            unsigned velocity, unsigned sample_rate);
-      void set_sustain(bool sustain);
+            unsigned velocity, unsigned sample_rate, unsigned frame = 0);
+      void set_sustain(bool sustain, unsigned frame = 0);
+
+      // Modulation changes are queued and take effect at the first control point,
+      // every Modulator::control_frames, at or after frame.
+      void set_pitch_bend(unsigned value, unsigned frame = 0);
+      void set_pressure(unsigned value, unsigned frame = 0);
+      void set_control(unsigned controller, unsigned value, unsigned frame = 0);
+      // Takes over the modulation of another instrument, e.g. on a program change.
+      void inherit_modulation(const Instrument &instrument);
+      inline void set_sample_rate(unsigned sample_rate) { this->sample_rate = sample_rate; }
+
+      void set_silence_threshold(float db);
+      void set_steal_policy(const StealPolicy &policy);
+      void set_envelope(float gain, float attack, float delay, float sustain_level, float release);
+
+      // Voices quieter than db, and past their attack, render at Quality::Reduced.
+      // They go back to full quality once they are 6 dB above the threshold.
+      void set_lod_threshold(float db);
+
+      // Caps the number of sounding voices below the polyphony given to init().
+      // Returns how many voices had to be faded out to honor the new limit.
+      unsigned set_voice_limit(unsigned limit);
+      inline unsigned get_voice_limit() const { return voice_limit; }
+      inline unsigned get_polyphony() const { return polyphony; }
+      inline unsigned sounding() const { return allocator.sounding(); }
+      // Queued controller changes are applied by render() even without voices.
+      inline bool idle() const { return active_voices.empty() && control_events.empty(); }
+
+      // Level of the voice which would be shed first, negative if none is sounding.
+      float quietest_level();
+      // Fades out the least audible sounding voice.
+      void shed_quietest();
+
+      // Voices like the ones of this instrument, with the same envelope, which are not
+      // managed by it. Null if the instrument has no voices.
+      std::unique_ptr<VoicePoolBase> create_voices(unsigned num_voices) const;
+
+      // Releases every held and sustained voice, as if all keys and the pedal were let go.
+      void release_all(unsigned frame = 0);
+
+      // Renders every voice once and resets, so code and voice state are paged in
+      // before the instrument is first played.
+      void prewarm(unsigned sample_rate);
+
+      // Renders voice groups on a worker pool, or on the calling thread if workers is
+      // null. Partial mixes are summed in a fixed order either way, so output is
+      // identical for any number of threads, including none.
+      // Blocks with more than channels channels are mixed voice by voice.
+      void set_worker_pool(WorkerPool *workers, unsigned channels);
 
       void reset();
 
    private:
-      std::vector<std::unique_ptr<Voice>> voices;
+      std::unique_ptr<VoicePoolBase> pool;
+      // Pool indices of voices which are currently sounding, in trigger order.
+      // Idle voices are never touched by render().
+      std::vector<unsigned> active_voices;
+      VoiceAllocator allocator;
+      unsigned polyphony = 0;
+      unsigned voice_limit = 0;
       bool sustain = false;
+      float lod_level = 0.00398f; // -48 dB
+      unsigned sample_rate = 44100;
+
+      Modulator modulation;
+      // The pitch curve voices render a chunk of up to max_job_frames with.
+      float pitch_points[max_job_frames / Modulator::control_frames];
+
+      struct ControlEvent
+      {
+         enum class Type : uint8_t { PitchBend, Pressure, Control };
+         Type type;
+         uint8_t controller;
+         uint16_t value;
+         unsigned frame;
+      };
+      enum { max_control_events = 64 };
+      std::vector<ControlEvent> control_events;
+      void queue_control(const ControlEvent &event);
+      void apply_control(const ControlEvent &event);
+
+      void render_block(const MixTarget &target, unsigned frames, bool use_workers);
+
+      inline void update_quality(Voice &tone, float level)
+      {
+         if (level < lod_level && !tone.in_attack())
+            tone.set_quality(Voice::Quality::Reduced);
+         else if (level > 2.0f * lod_level)
+            tone.set_quality(Voice::Quality::Full);
+      }
+
+      WorkerPool *workers = nullptr;
+      unsigned mix_channels = 0;
+      AlignedArray<float> mix_buffers;
+      std::vector<float*> job_outputs;
+
+      const float *job_amp = nullptr;
+      unsigned job_frames = 0;
+      unsigned job_channels = 0;
+
+      void allocate_mix_buffers();
+      void render_groups(const MixTarget &target, unsigned frames, bool parallel);
+      static void render_job(void *data, unsigned job);
 };
 
+// Multi-timbral synth. Every MIDI channel is a part which plays one program,
+// an Instrument with its own voice type and envelope.
+// Parts render concurrently when workers are available.
 class AirSynth : public Synthesizer
 {
    public:
@@ -191,19 +805,203 @@ class AirSynth : public Synthesizer
       AirSynth(AirSynth&&) = delete;
       void operator=(AirSynth&&) = delete;
 
-      void set_note(unsigned note, unsigned velocity) override;
-      void set_sustain(bool enable) override;
+      enum { num_programs = 128 };
+
+      void set_note(unsigned channel, unsigned note, unsigned velocity, unsigned frame = 0) override;
+      void set_sustain(unsigned channel, bool enable, unsigned frame = 0) override;
+
+      // Switches the program of a part with a pointer flip. Held notes of the old program
+      // are released and play out. Undefined programs, or programs with no free
+      // instance, are ignored. Never allocates, safe to call from the audio thread.
+      void set_program(unsigned channel, unsigned program, unsigned frame = 0) override;
+      void set_pitch_bend(unsigned channel, unsigned value, unsigned frame = 0) override;
+      void set_pressure(unsigned channel, unsigned value, unsigned frame = 0) override;
+      void set_control(unsigned channel, unsigned controller, unsigned value, unsigned frame = 0) override;
+      inline unsigned get_program(unsigned channel) const
+      {
+         return parts[channel].program.load(std::memory_order_relaxed);
+      }
+
+      inline bool has_program(unsigned program) const
+      {
+         return program < num_programs && !programs[program].instances.empty();
+      }
+
+      // Standalone voices of a program, e.g. for rendering notes outside the synth.
+      // Null if the program is not defined.
+      std::unique_ptr<VoicePoolBase> create_voices(unsigned program, unsigned voices) const;
+
+      void set_silence_threshold(float db);
+      void set_steal_policy(const StealPolicy &policy);
+      void set_envelope(unsigned program, float gain, float attack, float delay,
+            float sustain_level, float release);
+
+      // See Instrument::set_lod_threshold(). With the governor enabled,
+      // the threshold is raised by lod_pressure_db while the load is above target,
+      // so voices lose quality before any have to be shed.
+      void set_lod_threshold(float db);
+      float lod_pressure_db = 12.0f;
+
+      // Renders parts and voices on threads threads in total, including the audio thread.
+      // Worker threads run SCHED_FIFO at rt_priority unless it is negative.
+      void set_threads(unsigned threads, int rt_priority);
+
+      // Sheds the least audible voices when rendering takes too much of the buffer period.
+      // The voice limit is shared by all parts.
+      void enable_governor(bool enable);
+      inline const LoadGovernor::Stats &governor_stats() const { return governor.get_stats(); }
 
+      void configure_audio(unsigned sample_rate, unsigned channels) override;
+      void configure_buffer_size(unsigned frames) override;
       void process_audio(float **buffer, const float *amp, unsigned frames) override;
+      bool idle() const override;
+
+      // Which bus each part renders to with process_buses(): one bus in total, one per
+      // MIDI channel, or one per defined program, in program order. Instruments which
+      // finish notes of a previous program stay on the bus they were on.
+      // The first part on a bus renders straight into it, later ones add to it.
+      // Not real-time safe, must not be called while audio is running.
+      enum class Routing { Mixed, Channel, Program };
+      inline void set_routing(Routing routing) { this->routing = routing; }
+      unsigned buses() const override;
+      std::string bus_name(unsigned bus) const override;
+      void process_buses(float **buffer, const float *amp, unsigned frames) override;
+
+      // Silences every voice and controller, as if nothing had been played since parts
+      // were switched to their current programs. Lets one synth render many unrelated songs.
+      // Not real-time safe, must not be called while audio is running.
+      void reset();
+
+      // Defines a program. instances Instruments are allocated and pre-warmed up front,
+      // so at most instances parts can play, or finish notes of, the program at once.
+      // Not real-time safe, must not be called while audio is running.
+      template<typename T, typename... P>
+      void add_program(unsigned program, unsigned voices, unsigned instances, const P&... p)
+      {
+         remove_program(program);
+
+         auto &prog = programs[program];
+         for (unsigned i = 0; i < instances; i++)
+         {
+            std::unique_ptr<Instrument> instrument(new Instrument);
+            instrument->init<T>(voices, p...);
+            prog.instances.push_back(std::move(instrument));
+         }
+         setup_program(program);
+      }
 
+      // Makes T program 0 and switches every part to it.
       template<typename T, typename... P>
       void set_voices(unsigned voices, const P&&... p)
       {
-         instrument.init<T>(voices, p...);
+         add_program<T>(0, voices, num_midi_channels + spare_instances, p...);
+         for (unsigned channel = 0; channel < num_midi_channels; channel++)
+            set_program(channel, 0);
+         configure_governor();
       }
 
+      // Instances beyond one per part, which let notes of a previous program play out.
+      enum { spare_instances = 2 };
+
    private:
-      Instrument instrument;
+      struct Program
+      {
+         std::vector<std::unique_ptr<Instrument>> instances;
+         std::vector<Instrument*> free;
+      };
+      Program programs[num_programs];
+
+      struct Part
+      {
+         // Only switched on the audio thread, but may be read from any thread.
+         std::atomic<Instrument*> instrument{nullptr};
+         std::atomic<unsigned> program{0};
+      };
+      Part parts[num_midi_channels];
+
+      // Instruments of programs parts have switched away from, until their voices finish.
+      struct Draining
+      {
+         Instrument *instrument;
+         unsigned program;
+         unsigned channel;
+      };
+      std::vector<Draining> draining;
+
+      void remove_program(unsigned program);
+      void setup_program(unsigned program);
+      void recycle_drained();
+
+      template<typename Func>
+      inline void for_each_instance(const Func &func)
+      {
+         for (auto &prog : programs)
+            for (auto &instrument : prog.instances)
+               func(*instrument);
+      }
+
+      // Instruments which are currently played or draining.
+      template<typename Func>
+      inline void for_each_playing(const Func &func) const
+      {
+         for (auto &part : parts)
+         {
+            Instrument *instrument = part.instrument.load(std::memory_order_relaxed);
+            if (instrument)
+               func(*instrument);
+         }
+         for (auto &drain : draining)
+            func(*drain.instrument);
+      }
+
+      Routing routing = Routing::Mixed;
+      enum { max_buses = num_programs };
+      unsigned program_buses = 0;
+      unsigned program_bus[num_programs] = {};
+      bool bus_used[max_buses] = {};
+      void update_program_buses();
+
+      // Instruments with something to render in this block, in part order.
+      struct PartJob
+      {
+         Instrument *instrument;
+         unsigned bus;
+         // First on its bus, so it overwrites the bus instead of being added to it.
+         bool direct;
+      };
+      std::vector<PartJob> rendering;
+
+      // Scratch buffers for parts which do not render to their bus, summed in a fixed order.
+      unsigned part_channels = 0;
+      AlignedArray<float> part_buffers;
+      std::vector<float*> part_outputs;
+      // Where each job renders to, its bus or its scratch buffer.
+      std::vector<float*> job_outputs;
+      const float *job_amp = nullptr;
+      unsigned job_frames = 0;
+
+      void allocate_part_buffers();
+      void render(float **buffer, const float *amp, unsigned frames, bool routed);
+      void render_parts(float **buffer, const float *amp, unsigned frames, bool routed);
+      static void render_part_job(void *data, unsigned job);
+
+      std::unique_ptr<WorkerPool> workers;
+
+      LoadGovernor governor;
+      bool governor_enabled = false;
+      unsigned period_frames = 256;
+      unsigned voice_limit = 0;
+
+      void configure_governor();
+      unsigned polyphony() const;
+      unsigned sounding() const;
+      unsigned set_voice_limit(unsigned limit);
+
+      float silence_db = -96.0f;
+      StealPolicy steal_policy;
+      float lod_db = -48.0f;
+      bool lod_pressure = false;
+      void update_lod_pressure();
 };
 
 struct PolyphaseBank
@@ -214,42 +1012,76 @@ struct PolyphaseBank
    unsigned phases;
 };
 
-class NoiseIIR : public Voice 
+class NoiseIIR final : public Voice 
 {
    public:
       NoiseIIR();
       NoiseIIR(const PolyphaseBank *bank);
 
-      unsigned render(float **out, const float *amp, unsigned frames, unsigned channels) override;
+      unsigned render(const MixTarget &target, unsigned frames) override;
       void trigger(unsigned note, unsigned velocity, unsigned sample_rate, float detune) override;
+      void set_pitch(const PitchCurve &curve) override;
+      void skip_pitch(unsigned frames) override;
+      void seed(uint32_t seed) override;
+      uint64_t parameter_hash() const override;
+
+      // Voice state is kept inline so a VoicePool holds it all in one arena.
+      enum { max_taps = 64, max_iir_len = 300 };
 
    private:
+      unsigned interpolate_factor = 0;
+      unsigned decimate_factor = 0;
+      unsigned phase = 0;
+
+      // Phase step including modulation, with 8 fractional bits. Ramped per sample
+      // towards the next point of pitch.
+      enum { step_bits = 8 };
+      uint32_t phase_step = 0;
+      uint32_t step_target = 0;
+      int32_t step_delta = 0;
+      unsigned step_ramp = 0;
+      unsigned phase_frac = 0;
+      PitchRamp pitch;
+      inline void advance_phase();
+      void next_pitch_segment();
+      unsigned history_ptr = 0;
+      unsigned history_len = 0;
+
+      const PolyphaseBank *bank;
+
+      // Reduced quality uses a shorter filter with coarser phases, centered on the
+      // full filter so both have the same delay. Tier changes are crossfaded.
+      const PolyphaseBank *reduced_bank = nullptr;
+      unsigned reduced_shift = 0;
+      unsigned reduced_offset = 0;
+      Quality rendered_quality = Quality::Full;
+      unsigned crossfade = 0;
+      enum { crossfade_len = 64 };
+
+      inline void interpolate(Quality tier, float *res) const;
+
       struct IIR
       {
          const float *filter = nullptr;
-         std::vector<float> buffer;
          unsigned ptr = 0;
          unsigned len = 0;
          float step(float v);
          void set_filter(const float *filter, unsigned len);
          void reset();
+         void flush_denormals();
+         float buffer[2 * max_iir_len];
       } iir_l, iir_r;
 
-      unsigned interpolate_factor = 0;
-      unsigned decimate_factor = 0;
-      unsigned phase = 0;
-
-      std::vector<float> history_l;
-      std::vector<float> history_r;
-      unsigned history_ptr = 0;
-      unsigned history_len = 0;
+      float history_l[2 * max_taps];
+      float history_r[2 * max_taps];
 
       float noise_step(IIR &iir);
 
-      const PolyphaseBank *bank;
       std::default_random_engine engine;
       std::uniform_real_distribution<float> dist{-0.001, 0.001};
       static PolyphaseBank static_bank;
+      static PolyphaseBank static_reduced_bank;
+      static DenormalCounter denormals;
 };
 
 class Filter 
@@ -260,29 +1092,36 @@ class Filter
 
       inline float process(float samp)
       {
+         // History is newest first and mirrored, so it is read without wrapping around.
+         const float *src = buffer.data() + ptr;
          float iir_sum = samp;
          for (unsigned i = 1; i < a.size(); i++)
-            iir_sum -= a[i] * buffer[i - 1];
+            iir_sum -= a[i] * src[i - 1];
          iir_sum /= a[0];
 
-         buffer.push_front(iir_sum);
+         ptr = (ptr ? ptr : len) - 1;
+         buffer[ptr] = buffer[ptr + len] = iir_sum;
 
+         src = buffer.data() + ptr;
          float fir_sum = 0.0f;
          for (unsigned i = 0; i < b.size(); i++)
-            fir_sum += buffer[i] * b[i];
+            fir_sum += src[i] * b[i];
 
-         buffer.pop_back();
          return fir_sum;
       }
 
       void reset();
+      uint64_t hash(uint64_t hash) const;
 
    private:
       std::vector<float> b, a;
-      std::deque<float> buffer;
+      // Sized once, so processing never touches the heap.
+      std::vector<float> buffer;
+      unsigned ptr = 0;
+      unsigned len = 0;
 };
 
-class Square : public Voice 
+class Square final : public Voice 
 {
    public:
       Square();
@@ -291,8 +1130,11 @@ class Square : public Voice
       Square(Square&&);
       Square& operator=(Square&&);
 
-      unsigned render(float **out, const float *amp, unsigned frames, unsigned channels) override;
+      unsigned render(const MixTarget &target, unsigned frames) override;
       void trigger(unsigned note, unsigned velocity, unsigned sample_rate, float detune) override;
+      void set_pitch(const PitchCurve &curve) override;
+      void skip_pitch(unsigned frames) override;
+      uint64_t parameter_hash() const override;
 
    private:
       blipper_t *blip = nullptr;
@@ -300,13 +1142,29 @@ class Square : public Voice
       float delta;
       unsigned period;
 
+      // Period of the note itself. Impulses are spaced by the modulated period
+      // where they land, so the period follows the pitch ramp.
+      unsigned base_period;
+      PitchRamp pitch;
+      unsigned modulated_period(unsigned offset) const;
+
+      // Reduced quality pushes impulses through a shorter filter.
+      Quality rendered_quality = Quality::Full;
+      enum { reduced_taps = 16 };
+
+      // Longest period in 1/64 frames. Lower notes are not played. Blipper buffers up
+      // to one period beyond the frames which are rendered at once.
+      enum { max_period = 16 * 1024 * 64 };
+
       static std::vector<blipper_sample_t> filter_bank;
+      static std::vector<blipper_sample_t> reduced_filter_bank;
       static void init_filter();
+      static DenormalCounter denormals;
 
       Filter filter;
 };
 
-class Sawtooth : public Voice 
+class Sawtooth final : public Voice 
 {
    public:
       Sawtooth();
@@ -315,8 +1173,11 @@ class Sawtooth : public Voice
       Sawtooth(Sawtooth&&);
       Sawtooth& operator=(Sawtooth&&);
 
-      unsigned render(float **out, const float *amp, unsigned frames, unsigned channels) override;
+      unsigned render(const MixTarget &target, unsigned frames) override;
       void trigger(unsigned note, unsigned velocity, unsigned sample_rate, float detune) override;
+      void set_pitch(const PitchCurve &curve) override;
+      void skip_pitch(unsigned frames) override;
+      uint64_t parameter_hash() const override;
 
    private:
       blipper_t *blip = nullptr;
@@ -324,8 +1185,24 @@ class Sawtooth : public Voice
       float delta;
       unsigned period;
 
+      // Period of the note itself. Impulses are spaced by the modulated period
+      // where they land, so the period follows the pitch ramp.
+      unsigned base_period;
+      PitchRamp pitch;
+      unsigned modulated_period(unsigned offset) const;
+
+      // Reduced quality pushes impulses through a shorter filter.
+      Quality rendered_quality = Quality::Full;
+      enum { reduced_taps = 16 };
+
+      // Longest period in 1/64 frames. Lower notes are not played. Blipper buffers up
+      // to one period beyond the frames which are rendered at once.
+      enum { max_period = 16 * 1024 * 64 };
+
       static std::vector<blipper_sample_t> filter_bank;
+      static std::vector<blipper_sample_t> reduced_filter_bank;
       static void init_filter();
+      static DenormalCounter denormals;
 
       Filter filter;
 };
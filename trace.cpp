@@ -0,0 +1,362 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "trace.hpp"
+#include <stdexcept>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+static const char trace_magic[8] = { 'A', 'I', 'R', 'T', 'R', 'A', 'C', 'E' };
+
+static inline void write_u32(uint8_t *out, uint32_t value)
+{
+   for (unsigned i = 0; i < 4; i++)
+      out[i] = uint8_t(value >> (8 * i));
+}
+
+static inline uint32_t read_u32(const uint8_t *in)
+{
+   return uint32_t(in[0]) | (uint32_t(in[1]) << 8) | (uint32_t(in[2]) << 16) | (uint32_t(in[3]) << 24);
+}
+
+static inline Trace::Data encode(Trace::Record type, uint32_t value)
+{
+   Trace::Data data = {{ uint8_t(type) }};
+   write_u32(&data[4], value);
+   return data;
+}
+
+TraceWriter::TraceWriter(const string &path, unsigned channels, unsigned buses, unsigned records)
+{
+   capacity = 1;
+   while (capacity < records)
+      capacity <<= 1;
+
+   // Filled with zeros, so the ring is paged in before the audio thread writes to it.
+   ring.resize(capacity);
+
+   file = fopen(path.c_str(), "wb");
+   if (!file)
+      throw runtime_error("Failed to open trace file " + path + ".");
+
+   uint8_t header[Trace::header_size];
+   memcpy(header, trace_magic, sizeof(trace_magic));
+   write_u32(header + 8, Trace::version);
+   header[12] = uint8_t(channels);
+   header[13] = uint8_t(channels >> 8);
+   header[14] = uint8_t(buses);
+   header[15] = uint8_t(buses >> 8);
+   if (fwrite(header, sizeof(header), 1, file) != 1)
+   {
+      fclose(file);
+      throw runtime_error("Failed to write trace file " + path + ".");
+   }
+
+   thread = std::thread(&TraceWriter::writer_loop, this);
+}
+
+TraceWriter::~TraceWriter()
+{
+   dead = true;
+   thread.join();
+   fclose(file);
+
+   uint64_t lost = dropped();
+   if (lost)
+      fprintf(stderr, "[trace]: %llu records were dropped in total.\n",
+            static_cast<unsigned long long>(lost));
+}
+
+bool TraceWriter::write(const Trace::Data &data)
+{
+   uint64_t pos = write_pos.load(memory_order_relaxed);
+   uint64_t free_records = capacity - (pos - read_pos.load(memory_order_acquire));
+
+   // Once there is room again, the gap is noted before anything else.
+   if (unreported && free_records >= 2)
+   {
+      ring[pos & (capacity - 1)] = encode(Trace::Record::Dropped,
+            uint32_t(min(unreported, uint64_t(UINT32_MAX))));
+      pos++;
+      free_records--;
+      unreported = 0;
+   }
+
+   bool ok = free_records > 0 && !unreported;
+   if (ok)
+      ring[pos++ & (capacity - 1)] = data;
+   else
+   {
+      unreported++;
+      dropped_records.store(dropped_records.load(memory_order_relaxed) + 1, memory_order_relaxed);
+   }
+
+   write_pos.store(pos, memory_order_release);
+   return ok;
+}
+
+void TraceWriter::push_event(const AudioCallback::MidiEvent &event)
+{
+   auto raw = AudioCallback::get_raw(event);
+   if (!raw[0])
+      return;
+
+   Trace::Data data = {{ raw[0], raw[1], raw[2] }};
+   write_u32(&data[4], event.frame);
+   write(data);
+}
+
+void TraceWriter::push(Trace::Record type, uint32_t value)
+{
+   write(encode(type, value));
+}
+
+void TraceWriter::push_config(unsigned new_sample_rate, unsigned new_max_frames)
+{
+   if (new_sample_rate != sample_rate && write(encode(Trace::Record::SampleRate, new_sample_rate)))
+      sample_rate = new_sample_rate;
+   if (new_max_frames != max_frames && write(encode(Trace::Record::BufferSize, new_max_frames)))
+      max_frames = new_max_frames;
+}
+
+uint64_t TraceWriter::drain()
+{
+   uint64_t pos = read_pos.load(memory_order_relaxed);
+   uint64_t end = write_pos.load(memory_order_acquire);
+   uint64_t total = end - pos;
+
+   while (pos < end)
+   {
+      // Up to where the ring wraps around.
+      uint64_t offset = pos & (capacity - 1);
+      size_t records = size_t(min(end - pos, capacity - offset));
+      if (fwrite(ring[offset].data(), Trace::record_size, records, file) != records)
+         throw runtime_error("Failed to write trace.");
+      pos += records;
+      read_pos.store(pos, memory_order_release);
+   }
+
+   // What led up to a crash should be on disk.
+   if (total)
+      fflush(file);
+   return total;
+}
+
+void TraceWriter::writer_loop()
+{
+   uint64_t reported = 0;
+
+   try
+   {
+      while (!dead)
+      {
+         // The audio thread does not signal, it must not make system calls.
+         if (!drain())
+            this_thread::sleep_for(chrono::milliseconds(20));
+
+         uint64_t lost = dropped();
+         if (lost != reported)
+         {
+            fprintf(stderr, "[trace]: Disk cannot keep up, %llu records dropped so far.\n",
+                  static_cast<unsigned long long>(lost));
+            reported = lost;
+         }
+      }
+
+      drain();
+   }
+   catch (const exception &e)
+   {
+      // Audio keeps playing, the ring fills up and further records count as dropped.
+      fprintf(stderr, "[trace]: Tracing stopped: %s\n", e.what());
+   }
+}
+
+TraceReader::TraceReader(const string &path)
+{
+   FILE *file = fopen(path.c_str(), "rb");
+   if (!file)
+      throw runtime_error("Failed to open trace file " + path + ".");
+
+   uint8_t buffer[64 * 1024];
+   size_t read;
+   while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+      data.insert(end(data), buffer, buffer + read);
+   bool error = ferror(file);
+   fclose(file);
+
+   if (error)
+      throw runtime_error("Failed to read trace file " + path + ".");
+   parse(path);
+}
+
+TraceReader::TraceReader(vector<uint8_t> data)
+   : data(move(data))
+{
+   parse("Trace");
+}
+
+void TraceReader::parse(const string &name)
+{
+   if (data.size() < Trace::header_size || memcmp(data.data(), trace_magic, sizeof(trace_magic)) ||
+         read_u32(&data[8]) != Trace::version)
+      throw runtime_error(name + " is not a trace.");
+
+   num_channels = data[12] | (data[13] << 8);
+   num_buses = data[14] | (data[15] << 8);
+
+   // A trace cut short by a crash ends in a partial record, which is ignored.
+   data.resize(data.size() - (data.size() - Trace::header_size) % Trace::record_size);
+
+   Entry entry;
+   while (next(entry))
+   {
+      if (entry.midi)
+         continue;
+      if (entry.type == Trace::Record::SampleRate && !first_sample_rate)
+         first_sample_rate = entry.value;
+      else if (entry.type == Trace::Record::Block || entry.type == Trace::Record::BufferSize)
+         max_block_frames = max(max_block_frames, unsigned(entry.value));
+   }
+   rewind();
+}
+
+bool TraceReader::next(Entry &entry)
+{
+   if (pos + Trace::record_size > data.size())
+      return false;
+
+   const uint8_t *record = &data[pos];
+   entry.midi = record[0] & 0x80;
+   entry.type = static_cast<Trace::Record>(record[0]);
+   entry.raw = {{ record[0], record[1], record[2] }};
+   entry.value = read_u32(record + 4);
+   pos += Trace::record_size;
+   return true;
+}
+
+void TraceReader::rewind()
+{
+   pos = Trace::header_size;
+}
+
+vector<uint8_t> Trace::stress_script(unsigned channels, unsigned buses)
+{
+   vector<uint8_t> data(header_size);
+   memcpy(data.data(), trace_magic, sizeof(trace_magic));
+   write_u32(&data[8], version);
+   data[12] = uint8_t(channels);
+   data[13] = uint8_t(channels >> 8);
+   data[14] = uint8_t(buses);
+   data[15] = uint8_t(buses >> 8);
+
+   auto append = [&data](const Data &record) {
+      data.insert(end(data), begin(record), end(record));
+   };
+   auto event = [&append](unsigned status, unsigned lo, unsigned hi, unsigned frame) {
+      Data record = {{ uint8_t(status), uint8_t(lo), uint8_t(hi) }};
+      write_u32(&record[4], frame);
+      append(record);
+   };
+
+   // A fixed seed, so every run plays the same script.
+   uint32_t state = 1;
+   auto random = [&state](unsigned range) -> unsigned {
+      state = state * 1664525u + 1013904223u;
+      return (state >> 8) % range;
+   };
+
+   struct Phase
+   {
+      unsigned sample_rate;
+      unsigned max_frames;
+      unsigned blocks;
+   };
+   static const Phase phases[] = {
+      { 44100, 64, 400 },
+      { 48000, 256, 150 },
+      { 48000, 2048, 20 },
+   };
+
+   vector<unsigned> held[16];
+   for (auto &phase : phases)
+   {
+      append(encode(Record::SampleRate, phase.sample_rate));
+      append(encode(Record::BufferSize, phase.max_frames));
+
+      for (unsigned block = 0; block < phase.blocks; block++)
+      {
+         // JACK mostly runs full periods, but may run shorter ones.
+         unsigned frames = random(8) ? phase.max_frames : 1 + random(phase.max_frames);
+         unsigned count = random(2 + phase.max_frames / 128);
+
+         unsigned frame = 0;
+         for (unsigned i = 0; i < count; i++)
+         {
+            frame = min(frame + random(frames / count + 1), frames - 1);
+            unsigned channel = random(16);
+            auto &notes = held[channel];
+
+            unsigned kind = random(16);
+            if (kind < 6)
+            {
+               unsigned note = 24 + random(72);
+               event(0x90 | channel, note, 1 + random(127), frame);
+               notes.push_back(note);
+            }
+            else if (kind < 10)
+            {
+               if (notes.empty())
+                  continue;
+               unsigned index = random(notes.size());
+               // Half of the note-offs are note-ons with velocity 0.
+               if (random(2))
+                  event(0x80 | channel, notes[index], 64, frame);
+               else
+                  event(0x90 | channel, notes[index], 0, frame);
+               notes.erase(begin(notes) + index);
+            }
+            else if (kind == 10)
+               event(0xb0 | channel, 64, random(2) * 127, frame);
+            else if (kind == 11)
+               event(0xe0 | channel, random(128), random(128), frame);
+            else if (kind == 12)
+               event(0xb0 | channel, 1, random(128), frame);
+            else if (kind == 13)
+               event(0xd0 | channel, random(128), 0, frame);
+            else if (kind == 14)
+               event(0xb0 | channel, 76 + random(2), random(128), frame);
+            else if (random(4))
+            {
+               // Bend range through RPN 0.
+               event(0xb0 | channel, 101, 0, frame);
+               event(0xb0 | channel, 100, 0, frame);
+               event(0xb0 | channel, 6, random(25), frame);
+            }
+            else
+               event(0xc0 | channel, random(3), 0, frame);
+         }
+
+         append(encode(Record::Block, frames));
+      }
+   }
+
+   return data;
+}
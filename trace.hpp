@@ -0,0 +1,148 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef TRACE_HPP__
+#define TRACE_HPP__
+
+#include <atomic>
+#include <thread>
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdio>
+#include <cstdint>
+#include "audio_driver.hpp"
+
+// A session trace logs what a real-time driver fed the synth: every MIDI event at
+// its frame, the size of every block, configuration changes and xruns. Replaying it
+// drives the synth with the same sequence offline, see ReplayDriver.
+//
+// The file starts with a 16 byte header: "AIRTRACE", the version as a uint32, then
+// channels and buses as uint16. It is followed by 8 byte records. A record starting
+// with a MIDI status byte is a message of three bytes, anything else a Record type,
+// with a uint32 value at offset 4. For messages, that is the frame in the block.
+// The events of a block come right before its Block record. Values are little endian.
+namespace Trace
+{
+   enum { header_size = 16, record_size = 8, version = 1 };
+
+   enum class Record : uint8_t
+   {
+      Block = 1,  // Frames in the block.
+      SampleRate, // Sample rate from here on.
+      BufferSize, // Largest block from here on.
+      Xrun,       // Xruns reported since the last block.
+      Dropped     // Records lost because the disk could not keep up.
+   };
+
+   typedef std::array<uint8_t, record_size> Data;
+
+   // A fixed script in trace format: dense notes, pedal, bends, modulation and program
+   // changes on every MIDI channel, in blocks of several sizes and at two sample rates.
+   // Replaying it tests that rendering never allocates without a recorded session.
+   std::vector<uint8_t> stress_script(unsigned channels, unsigned buses);
+}
+
+// Writes a trace from the real-time thread. Records go through a preallocated
+// single-producer, single-consumer ring, and a background thread writes them out.
+// When the ring is full, records are dropped, and the trace says how many.
+class TraceWriter
+{
+   public:
+      // The ring holds at least capacity records.
+      TraceWriter(const std::string &path, unsigned channels, unsigned buses,
+            unsigned capacity = 1 << 16);
+      // Writes out what is left in the ring and closes the file.
+      ~TraceWriter();
+
+      TraceWriter(TraceWriter&&) = delete;
+      void operator=(TraceWriter&&) = delete;
+
+      // Real-time safe. Called by the audio thread only.
+      void push_event(const AudioCallback::MidiEvent &event);
+      void push(Trace::Record type, uint32_t value);
+      // Records the configuration if it changed since the last call.
+      void push_config(unsigned sample_rate, unsigned max_frames);
+
+      inline uint64_t dropped() const { return dropped_records.load(std::memory_order_relaxed); }
+
+   private:
+      FILE *file = nullptr;
+      std::vector<Trace::Data> ring;
+      uint64_t capacity;
+
+      unsigned sample_rate = 0;
+      unsigned max_frames = 0;
+      // Dropped, but not yet noted in the trace. Audio thread only.
+      uint64_t unreported = 0;
+
+      // Positions count records since the start and only ever grow.
+      // Kept on separate cache lines, each is written by one thread only.
+      std::atomic<uint64_t> write_pos{0};
+      char padding[64];
+      std::atomic<uint64_t> read_pos{0};
+      std::atomic<uint64_t> dropped_records{0};
+
+      std::atomic<bool> dead{false};
+      std::thread thread;
+
+      bool write(const Trace::Data &data);
+      void writer_loop();
+      // Writes out everything in the ring. Returns the records written.
+      uint64_t drain();
+};
+
+// A trace loaded into memory.
+class TraceReader
+{
+   public:
+      // Throws if the file cannot be read or is not a trace.
+      explicit TraceReader(const std::string &path);
+      // A trace which is already in memory, such as Trace::stress_script().
+      explicit TraceReader(std::vector<uint8_t> data);
+
+      struct Entry
+      {
+         bool midi;
+         Trace::Record type;
+         AudioCallback::MidiRawData raw;
+         uint32_t value;
+      };
+
+      // False at the end of the trace.
+      bool next(Entry &entry);
+      void rewind();
+
+      inline unsigned channels() const { return num_channels; }
+      inline unsigned buses() const { return num_buses; }
+      // Of the first SampleRate record, 0 if there is none.
+      inline unsigned sample_rate() const { return first_sample_rate; }
+      // Largest block in the trace.
+      inline unsigned max_frames() const { return max_block_frames; }
+
+   private:
+      std::vector<uint8_t> data;
+      size_t pos = Trace::header_size;
+      unsigned num_channels = 0;
+      unsigned num_buses = 0;
+      unsigned first_sample_rate = 0;
+      unsigned max_block_frames = 0;
+
+      void parse(const std::string &name);
+};
+
+#endif
@@ -0,0 +1,186 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "worker_pool.hpp"
+#include "denormal.hpp"
+#include "realtime.hpp"
+#include <cstdio>
+#include <climits>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// PAUSE takes anywhere from 10 to 140 cycles depending on the CPU, so this spins for
+// roughly 0.05-0.5 ms before parking (0.22 ms measured on a recent Xeon). That keeps
+// workers awake across the many run() calls of one period, parts and chunks, and
+// usually into the next period at small buffer sizes.
+static const unsigned spin_count = 10000;
+
+static inline void cpu_relax()
+{
+#if defined(AIRSYNTH_DENORMAL_SSE)
+   _mm_pause();
+#endif
+}
+
+static inline void futex_wait(atomic<unsigned> &word, unsigned value)
+{
+#ifdef __linux__
+   syscall(SYS_futex, reinterpret_cast<unsigned*>(&word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+#else
+   (void)word;
+   (void)value;
+   this_thread::yield();
+#endif
+}
+
+static inline void futex_wake(atomic<unsigned> &word)
+{
+#ifdef __linux__
+   syscall(SYS_futex, reinterpret_cast<unsigned*>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+   (void)word;
+#endif
+}
+
+WorkerPool::WorkerPool(unsigned num_workers, int rt_priority)
+   : queues(num_workers + 1), generation(0), pending(0), sleepers(0), dead(false)
+{
+   unsigned cpus = max(thread::hardware_concurrency(), 1u);
+
+   for (unsigned i = 0; i < num_workers; i++)
+   {
+      workers.emplace_back(&WorkerPool::worker_loop, this, i + 1);
+      auto handle = workers.back().native_handle();
+
+#ifdef __linux__
+      // Workers take cores 1 and up, wrapping around. The calling thread is not pinned,
+      // but with at most one worker per other core, as AirSynth limits it, no worker
+      // competes with it for core 0.
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET((i + 1) % cpus, &set);
+      if (pthread_setaffinity_np(handle, sizeof(set), &set) != 0)
+         fprintf(stderr, "[WorkerPool]: Failed to pin worker %u.\n", i);
+#endif
+
+      if (rt_priority >= 0)
+      {
+         sched_param param = {};
+         param.sched_priority = rt_priority;
+         if (pthread_setschedparam(handle, SCHED_FIFO, &param) != 0)
+            fprintf(stderr, "[WorkerPool]: Failed to set SCHED_FIFO for worker %u.\n", i);
+      }
+   }
+}
+
+WorkerPool::~WorkerPool()
+{
+   dead = true;
+   generation.fetch_add(1);
+   futex_wake(generation);
+
+   for (auto &worker : workers)
+      worker.join();
+}
+
+void WorkerPool::wake_all()
+{
+   if (sleepers.load() != 0)
+      futex_wake(generation);
+}
+
+void WorkerPool::run(JobFunc func, void *data, unsigned num_jobs)
+{
+   unsigned participants = threads();
+   if (participants == 1 || num_jobs <= 1)
+   {
+      for (unsigned i = 0; i < num_jobs; i++)
+         func(data, i);
+      return;
+   }
+
+   this->func = func;
+   this->data = data;
+   for (unsigned i = 0; i < participants; i++)
+   {
+      queues[i].next.store(i * num_jobs / participants, memory_order_relaxed);
+      queues[i].end = (i + 1) * num_jobs / participants;
+   }
+   pending.store(workers.size(), memory_order_relaxed);
+
+   generation.fetch_add(1);
+   wake_all();
+
+   work(0);
+   while (pending.load(memory_order_acquire) != 0)
+      cpu_relax();
+}
+
+void WorkerPool::work(unsigned self)
+{
+   unsigned participants = threads();
+   for (unsigned i = 0; i < participants; i++)
+   {
+      auto &queue = queues[(self + i) % participants];
+      for (;;)
+      {
+         unsigned job = queue.next.fetch_add(1, memory_order_relaxed);
+         if (job >= queue.end)
+            break;
+         func(data, job);
+      }
+   }
+}
+
+void WorkerPool::worker_loop(unsigned self)
+{
+   DenormalGuard denormal_guard;
+   RealTime::prefault_stack();
+   // Workers only ever run render jobs.
+   AllocationCheck allocation_check;
+   unsigned seen = 0;
+
+   for (;;)
+   {
+      unsigned spins = 0;
+      while (generation.load() == seen)
+      {
+         if (++spins < spin_count)
+            cpu_relax();
+         else
+         {
+            sleepers.fetch_add(1);
+            futex_wait(generation, seen);
+            sleepers.fetch_sub(1);
+         }
+      }
+
+      seen = generation.load();
+      if (dead)
+         return;
+
+      work(self);
+      pending.fetch_sub(1, memory_order_release);
+   }
+}
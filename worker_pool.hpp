@@ -0,0 +1,77 @@
+/*  AirSynth - A simple realtime softsynth for ALSA.
+ *  Copyright (C) 2013 - Hans-Kristian Arntzen
+ * 
+ *  AirSynth is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  AirSynth is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with AirSynth.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef WORKER_POOL_HPP__
+#define WORKER_POOL_HPP__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "aligned.hpp"
+
+// Pool of pinned worker threads for use from a real-time thread.
+// Dispatching work never takes a lock or allocates.
+// Idle workers spin for a short while before parking on a futex.
+class WorkerPool
+{
+   public:
+      typedef void (*JobFunc)(void *data, unsigned job);
+
+      // rt_priority < 0 keeps the default scheduling policy.
+      WorkerPool(unsigned num_workers, int rt_priority);
+      ~WorkerPool();
+
+      WorkerPool(WorkerPool&&) = delete;
+      void operator=(WorkerPool&&) = delete;
+
+      // Threads taking part in run(), including the caller.
+      inline unsigned threads() const { return workers.size() + 1; }
+
+      // Calls func(data, job) for every job in [0, num_jobs).
+      // The calling thread takes part and returns once all jobs are complete.
+      // Jobs are split evenly up front, threads which run dry steal from the others.
+      void run(JobFunc func, void *data, unsigned num_jobs);
+
+   private:
+      struct Queue
+      {
+         std::atomic<unsigned> next;
+         unsigned end;
+      };
+
+      // Keep every queue on its own cache line.
+      struct PaddedQueue : Queue
+      {
+         char padding[AlignedArray<char>::alignment - sizeof(Queue)];
+      };
+
+      std::vector<std::thread> workers;
+      AlignedArray<PaddedQueue> queues;
+
+      std::atomic<unsigned> generation;
+      std::atomic<unsigned> pending;
+      std::atomic<unsigned> sleepers;
+      std::atomic<bool> dead;
+
+      JobFunc func = nullptr;
+      void *data = nullptr;
+
+      void worker_loop(unsigned self);
+      void work(unsigned self);
+      void wake_all();
+};
+
+#endif